@@ -21,13 +21,14 @@ void buttonCallback2(char* topic, uint8_t* payload, unsigned int length) {
     Serial.println("Button 2 pressed");
 }
 
-void garagecallback(char* topic, uint8_t* payload, unsigned int length) {
-    char p[length +1];
-    memcpy(p, payload, length);
-    p[length] = NULL;
-    String message(p);
-
-    Serial.println("Garage door " + message);
+void garagecallback(const char* topic, const PayloadView& payload) {
+    if (payload.equals("OPEN")) {
+        Serial.println("Garage door opening");
+    } else if (payload.equals("CLOSE")) {
+        Serial.println("Garage door closing");
+    } else if (payload.equals("STOP")) {
+        Serial.println("Garage door stopping");
+    }
 }
 
 // Create our sensors
@@ -38,49 +39,66 @@ Button myButton("button", "Button but bigger", client, dev, buttonCallback);
 Button myButton2("button2", "Button but bigger2", client, dev, buttonCallback2);
 Cover myGarage("garage", "Garage Door", client, dev, garagecallback, Cover::DeviceClasses::garage);
 
+// Only publish changes, but remind Home Assistant of the current value every 5 minutes
+ReportingPolicy onChange = {
+    .suppressDuplicates = true,
+    .heartbeat = 5 * 60 * 1000,
+};
+
+// Ignore temperature jitter below half a degree and publish at most every 5 seconds
+ReportingPolicy temperaturePolicy = {
+    .absoluteDeadband = 0.5,
+    .minInterval = 5000,
+    .heartbeat = 5 * 60 * 1000,
+};
+
 // Initialize objects from the lib
 void setup() {
     waitUntil(Particle.connected);
     Serial.begin();
-    Serial.println("Trying connect");
-    client.connect("mqtt_user", "mqtt_password");
-    if (client.isConnected()) {
-        Serial.println("Connected");
-        client.registerEntity(&tamper);
-        client.registerEntity(&temperature);
-        client.registerEntity(&garageHealth);
-        client.registerEntity(&myButton);
-        client.registerEntity(&myButton2);
-        client.registerEntity(&myGarage);
-    } else {
-        Serial.println("Not connected");
-    }
+
+    // Sample everything first, client.loop() then publishes all changed states in one batch
+    client.setDeferredPublishing(true);
+    // Never send more than 2 messages per client.loop(), discovery is spread over the first few loops
+    client.setPublishBudget(2);
+    client.onDiscoveryComplete([]() { Serial.println("Discovery complete"); });
+    // Let the broker keep our subscriptions and queue commands while we are offline
+    client.setCleanSession(false);
+
+    tamper.setReportingPolicy(onChange);
+    garageHealth.setReportingPolicy(onChange);
+    temperature.setReportingPolicy(temperaturePolicy);
+    // Entities stay registered across reconnects, discovery is sent whenever we connect
+    client.registerEntity(&tamper);
+    client.registerEntity(&temperature);
+    client.registerEntity(&garageHealth);
+    client.registerEntity(&myButton);
+    client.registerEntity(&myButton2);
+    client.registerEntity(&myGarage);
+
+    // client.loop() connects, and reconnects with backoff whenever the broker goes away
+    client.begin("mqtt_user", "mqtt_password");
 }
 
 void loop() {
     static int i = 0;
-    if (client.isConnected()) {
-        if (i % 10 == 0) {
-            tamper.updateState(BinarySensor::States::ON);
-            temperature.updateState(String(25 + i));
-            garageHealth.updateState("healthy");
-            Serial.println("Changing temperature to " + String(25 + i));
-        } else {
-            tamper.updateState(BinarySensor::States::OFF);
-        }
-        i++;
-        delay(1000);
-        client.publishAvailabilities();
-        client.loop();
+    static MQTT_HASS::ConnectionStates lastState = MQTT_HASS::ConnectionStates::Disconnected;
+
+    // Sampling never waits for the broker, states recorded while offline are published after reconnecting
+    if (i % 10 == 0) {
+        tamper.updateState(BinarySensor::States::ON);
+        temperature.updateState(25 + i);
+        garageHealth.updateState("healthy");
+        Serial.println("Changing temperature to " + String(25 + i));
     } else {
-        client.connect("mqtt_user", "mqtt_password");
-        if (client.isConnected()) {
-            Serial.println("Connected");
-            client.registerEntity(&tamper);
-            client.registerEntity(&myButton);
-            client.registerEntity(&myButton2);
-            client.registerEntity(&myGarage);
-            client.registerEntity(&temperature);
-        }
+        tamper.updateState(BinarySensor::States::OFF);
+    }
+    i++;
+    delay(1000);
+    client.loop();
+
+    if (client.connectionState() != lastState) {
+        lastState = client.connectionState();
+        Serial.println(lastState == MQTT_HASS::ConnectionStates::Online ? "Connected" : "Connection state changed");
     }
 }
@@ -3,6 +3,9 @@
 
 #include "MQTT_HASS.h"
 
+#include <limits.h>
+#include <math.h>
+
 MQTT_HASS *MQTT_HASS::instance_ = nullptr;
 
 MQTT_HASS::MQTT_HASS(const char *domain, uint16_t port)
@@ -24,53 +27,509 @@ bool MQTT_HASS::connect(const char *username, const char *password) {
 	if (MQTT::isConnected())
 		return true;
 
-  if (!entities_.isEmpty())
-    entities_.clear();
-  if (!MQTT::connect("particle" + Utils::getSerialNum() + String(Time.now()),username, password))
+  // The serial number never changes, so the identity strings are built on the first connect only
+  if (clientId_.length() == 0) {
+    String serial = Utils::serialNum();
+    // The client ID must stay the same across reconnects for the broker to resume our session
+    clientId_ = "particle" + serial;
+    availabilityTopic_ = "homeassistant/particle_" + serial + "/availability";
+    sessionTopic_ = "homeassistant/particle_" + serial + "/session";
+  }
+
+  // The broker publishes "offline" for us when the connection drops, so "online" only needs sending once
+  if (!MQTT::connect(clientId_, username, password,
+                     availabilityTopic_, MQTT::QOS0, true, "offline", cleanSession_))
+		return false;
+
+	if (!publishAvailabilities())
+		return false;
+
+	// The MQTT library doesn't expose CONNACK's session present flag. A resumed session still holds our
+	// subscription to the session topic, so loop() waits for a nonce published there to come back.
+	if (!cleanSession_ && sessionEstablished_) {
+		sessionNonce_ = String(HAL_RNG_GetRandomNumber());
+		sessionProbing_ = true;
+		sessionProbeAt_ = millis();
+		return MQTT::publish(sessionTopic_, sessionNonce_);
+	}
+
+	return startSession();
+}
+
+bool MQTT_HASS::startSession() {
+	if (!MQTT::subscribe("homeassistant/status"))
+		return false;
+
+	for (auto it = entities_; it != entities_ + entityCount_; it++) {
+		if (isFirstCommandOfDevice(*it) && !subscribeCommands(*it))
+			return false;
+	}
+
+	if (!cleanSession_ && !MQTT::subscribe(sessionTopic_, MQTT::QOS1))
 		return false;
+	sessionEstablished_ = !cleanSession_;
 
-	return !MQTT::subscribe("homeassistant/status");
+	// Registered entities survive reconnects, loop() replays their discovery
+	queueAllDiscovery();
+	return true;
+}
+
+void MQTT_HASS::begin(const char *username, const char *password) {
+  username_ = username;
+  password_ = password;
+  autoConnect_ = true;
+  retryDelay_ = 0;
+}
+
+bool MQTT_HASS::reconnect() {
+  unsigned long now = millis();
+  if (now - lastAttempt_ < retryDelay_)
+    return false;
+
+  lastAttempt_ = now;
+  if (connect(username_, password_)) {
+    backoff_ = 0;
+    retryDelay_ = 0;
+    return true;
+  }
+
+  // Pick the delay at random from the upper half of the backoff, so a fleet doesn't retry in lockstep
+  if (backoff_ == 0)
+    backoff_ = MQTT_HASS_RECONNECT_MIN_DELAY;
+  else if (backoff_ < MQTT_HASS_RECONNECT_MAX_DELAY / 2)
+    backoff_ *= 2;
+  else
+    backoff_ = MQTT_HASS_RECONNECT_MAX_DELAY;
+  retryDelay_ = backoff_ / 2 + HAL_RNG_GetRandomNumber() % (backoff_ / 2 + 1);
+  return false;
+}
+
+MQTT_HASS::ConnectionStates MQTT_HASS::connectionState() {
+  if (!MQTT::isConnected())
+    return autoConnect_ ? ConnectionStates::Reconnecting : ConnectionStates::Disconnected;
+  if (sessionProbing_)
+    return ConnectionStates::Resuming;
+  if (!isDiscoveryComplete())
+    return ConnectionStates::Discovering;
+  return ConnectionStates::Online;
+}
+
+void MQTT_HASS::setCleanSession(bool clean) {
+  cleanSession_ = clean;
 }
 
 bool MQTT_HASS::registerEntity(Entity *entity)
 {
-    entity->publishDiscovery();
-    return entities_.append(entity);
+    for (auto it = entities_; it != entities_ + entityCount_; it++) {
+      if (*it == entity)
+        return true;
+    }
+
+    if (entityCount_ == MQTT_HASS_MAX_ENTITIES) {
+      Log.error("Cannot register %s, all %d entity slots are in use (raise MQTT_HASS_MAX_ENTITIES)",
+                entity->name_.c_str(), MQTT_HASS_MAX_ENTITIES);
+      return false;
+    }
+
+    // Build the unique id now, so discovery never has to read the serial number or allocate it
+    entity->uniqueId();
+    if (isFirstOfDevice(entity))
+      entity->buildDeviceTopic();
+    entity->index_ = entityCount_;
+    entities_[entityCount_++] = entity;
+
+    if (entity->hasCommand())
+      addRoute(entity);
+
+    // Building and sending the config blocks on the network, so leave it to loop(). Entities registered while
+    // offline are queued too, a resumed session skips the full rediscovery that connect() would otherwise queue.
+    queueDiscovery(entity);
+
+    if (!MQTT::isConnected()) {
+      // A resumed session would lack the new device's command subscription, so start a fresh one
+      if (isFirstCommandOfDevice(entity))
+        sessionEstablished_ = false;
+      return true;
+    }
+
+    return !isFirstCommandOfDevice(entity) || subscribeCommands(entity);
 }
 
-bool MQTT_HASS::publishAvailabilities() {
-  for (auto it = entities_.begin(); it != entities_.end(); it++) {
-    Entity *entity = *it;
-    if (!entity->publishAvailability())
+void MQTT_HASS::setDiscoveryMode(DiscoveryModes mode) {
+  discoveryMode_ = mode;
+}
+
+void MQTT_HASS::setCompactDiscovery(bool compact) {
+  compactDiscovery_ = compact;
+}
+
+void MQTT_HASS::setDeviceInfoOnce(bool once) {
+  deviceInfoOnce_ = once;
+}
+
+bool MQTT_HASS::isFirstOfDevice(Entity *entity) {
+  for (auto it = entities_; it != entities_ + entityCount_ && *it != entity; it++) {
+    if (&(*it)->dev_ == &entity->dev_)
       return false;
   }
 
   return true;
 }
 
+bool MQTT_HASS::isFirstCommandOfDevice(Entity *entity) {
+  if (!entity->hasCommand())
+    return false;
+
+  for (auto it = entities_; it != entities_ + entityCount_ && *it != entity; it++) {
+    if (&(*it)->dev_ == &entity->dev_ && (*it)->hasCommand())
+      return false;
+  }
+
+  return true;
+}
+
+bool MQTT_HASS::subscribeCommands(Entity *entity) {
+  // One wildcard covers every command entity of the device, globalCallback() routes the messages locally
+  // QoS1 lets the broker queue commands sent while we are offline
+  return MQTT::subscribe("homeassistant/+/particle_" + entity->dev_.name + "/+/command", MQTT::QOS1);
+}
+
+bool MQTT_HASS::publishDiscoveries() {
+  bool ok = true;
+  forgetDiscoveries();
+
+  if (discoveryMode_ == DiscoveryModes::PerEntity) {
+    for (auto it = entities_; it != entities_ + entityCount_; it++) {
+      Entity *entity = *it;
+      if (!entity->publishDiscovery())
+        ok = false;
+    }
+    return ok;
+  }
+
+  // One payload per distinct device, emitted when we reach the first entity that belongs to it
+  for (auto it = entities_; it != entities_ + entityCount_; it++) {
+    Entity *entity = *it;
+    if (isFirstOfDevice(entity) && !publishDeviceDiscovery(entity))
+      ok = false;
+  }
+
+  return ok;
+}
+
+bool MQTT_HASS::publishDeviceDiscovery(Entity *first) {
+  const char *topic = first->deviceTopic_;
+  JSONBufferWriter writer(discoveryBuffer_, discoveryCapacity(topic));
+
+  writer.beginObject();
+  first->fillDeviceJSON(writer, true);
+  writer.name(compactDiscovery_ ? "o" : "origin").beginObject();
+    writer.name("name").value("MQTT_HASS");
+  writer.endObject();
+  // Shared options at the root of a device payload apply to every component
+  writer.name(compactDiscovery_ ? "avty_t" : "availability_topic").value(availabilityTopic_);
+  writer.name(compactDiscovery_ ? "cmps" : "components").beginObject();
+  for (auto it = entities_; it != entities_ + entityCount_; it++) {
+    Entity *entity = *it;
+    if (&entity->dev_ != &first->dev_)
+      continue;
+    writer.name(entity->uniqueId()).beginObject();
+      writer.name(compactDiscovery_ ? "p" : "platform").value(entity->component_);
+      entity->fillTopicBaseJSON(writer);
+      entity->fillDiscoveryJSON(writer);
+    writer.endObject();
+  }
+  writer.endObject();
+  writer.endObject();
+
+  return publishConfig(first, topic, writer);
+}
+
+size_t MQTT_HASS::discoveryCapacity(const char *topic) {
+  // Whatever the MQTT library can't fit in its packet next to the topic would be rejected, so stop the writer there
+  size_t overhead = PUBLISH_HEADER_SIZE + strlen(topic);
+  return overhead < MQTT_PACKET_SIZE ? MQTT_PACKET_SIZE - overhead : 0;
+}
+
+bool MQTT_HASS::publishConfig(Entity *owner, const char *topic, JSONBufferWriter &writer) {
+  // A device with many entities can outgrow the packet; never publish a truncated payload
+  if (writer.dataSize() > writer.bufferSize()) {
+    configTooLarge_ = true;
+    Log.error("Discovery for %s needs %u bytes, only %u fit", topic, (unsigned)writer.dataSize(), (unsigned)writer.bufferSize());
+    return false;
+  }
+
+  // The broker retains the config, so Home Assistant still has it if nothing changed since we last sent it
+  discoveryBuffer_[writer.dataSize()] = '\0';
+  uint32_t hash = Utils::hash(discoveryBuffer_);
+  if (hash == owner->discoveryHash_)
+    return true;
+
+  if (!MQTT::publish(topic, reinterpret_cast<const uint8_t*>(discoveryBuffer_), writer.dataSize(), true))
+    return false;
+
+  owner->discoveryHash_ = hash;
+  configSent_ = true;
+  return true;
+}
+
+void MQTT_HASS::forgetDiscoveries() {
+  for (auto it = entities_; it != entities_ + entityCount_; it++)
+    (*it)->discoveryHash_ = 0;
+}
+
+void MQTT_HASS::queueDiscovery(Entity *entity) {
+  // A device payload covers all of the device's entities, so only its first entity is queued
+  if (discoveryMode_ == DiscoveryModes::PerDevice) {
+    for (auto it = entities_; it != entities_ + entityCount_; it++) {
+      if (&(*it)->dev_ == &entity->dev_) {
+        entity = *it;
+        break;
+      }
+    }
+  }
+
+  setBit(discoveryQueue_, entity->index_);
+  discoveryActive_ = true;
+}
+
+void MQTT_HASS::queueAllDiscovery() {
+  for (auto it = entities_; it != entities_ + entityCount_; it++) {
+    Entity *entity = *it;
+    if (discoveryMode_ == DiscoveryModes::PerEntity || isFirstOfDevice(entity))
+      setBit(discoveryQueue_, entity->index_);
+  }
+
+  discoveryActive_ = true;
+}
+
+bool MQTT_HASS::isDiscoveryComplete() { return !rediscoveryScheduled_ && !isDiscoveryQueued(); }
+
+void MQTT_HASS::onDiscoveryComplete(void (*callbackPtr)()) {
+  discoveryCallbackPtr_ = callbackPtr;
+}
+
+bool MQTT_HASS::publishQueuedDiscovery(int &budget) {
+  for (int word = 0; word < BITMAP_WORDS; word++) {
+    uint32_t bits = discoveryQueue_[word];
+    while (bits != 0) {
+      if (budget <= 0)
+        return true;
+
+      int index = word * 32 + __builtin_ctz(bits);
+      bits &= bits - 1;
+
+      Entity *entity = entities_[index];
+      configTooLarge_ = false;
+      configSent_ = false;
+      bool ok = discoveryMode_ == DiscoveryModes::PerDevice ? publishDeviceDiscovery(entity) : entity->publishDiscovery();
+      // Configs the broker still retains unchanged are skipped without sending anything, so they are free
+      if (configSent_)
+        budget--;
+      // A failed publish is retried by the next loop(), but a config that doesn't fit in a packet never will,
+      // so it is dropped (publishConfig() already logged it) instead of blocking everything queued behind it
+      if (!ok && !configTooLarge_)
+        return false;
+      clearBit(discoveryQueue_, index);
+
+      // The device payload covered every entity of the device, even those queued before the mode was changed
+      if (discoveryMode_ == DiscoveryModes::PerDevice) {
+        for (auto it = entities_; it != entities_ + entityCount_; it++) {
+          if (&(*it)->dev_ == &entity->dev_)
+            clearBit(discoveryQueue_, (*it)->index_);
+        }
+        bits &= discoveryQueue_[word];
+      }
+    }
+  }
+
+  return true;
+}
+
+bool MQTT_HASS::isDiscoveryQueued() {
+  for (int word = 0; word < BITMAP_WORDS; word++) {
+    if (discoveryQueue_[word] != 0)
+      return true;
+  }
+
+  return false;
+}
+
+void MQTT_HASS::setRediscoveryJitter(uint32_t maxDelay) {
+  rediscoveryJitter_ = maxDelay;
+}
+
+void MQTT_HASS::setPublishBudget(uint16_t budget) {
+  publishBudget_ = budget;
+}
+
+void MQTT_HASS::scheduleRediscovery() {
+  // Home Assistant restarted and may have lost retained configs along with the broker, so resend them all
+  forgetDiscoveries();
+  queueAllDiscovery();
+
+  // Every device sees the birth message at the same moment, a random delay spreads the fleet's rediscovery out.
+  // The hardware RNG is used so devices don't share a pseudo random sequence.
+  rediscoveryAt_ = millis() + (rediscoveryJitter_ == 0 ? 0 : HAL_RNG_GetRandomNumber() % (rediscoveryJitter_ + 1));
+  rediscoveryScheduled_ = true;
+}
+
+bool MQTT_HASS::loop() {
+  // While the broker is unreachable only the occasional connection attempt may block
+  if (!MQTT::loop() && !(autoConnect_ && reconnect()))
+    return false;
+
+  if (sessionProbing_ && millis() - sessionProbeAt_ >= MQTT_HASS_SESSION_PROBE_TIMEOUT) {
+    // The nonce never came back, the broker started a new session without our subscriptions
+    sessionProbing_ = false;
+    startSession();
+  }
+
+  int budget = publishBudget_ == 0 ? INT_MAX : publishBudget_;
+
+  if ((!rediscoveryScheduled_ || (long)(millis() - rediscoveryAt_) >= 0) && publishQueuedDiscovery(budget)
+      && !isDiscoveryQueued()) {
+    if (rediscoveryScheduled_ && budget > 0) {
+      // Rediscovery is complete, Home Assistant lost every non-retained state so send them again. The availability
+      // shares the budget with the configs, once it is spent it waits for the next call.
+      rediscoveryScheduled_ = false;
+      budget--;
+      publishAvailabilities();
+      for (auto it = entities_; it != entities_ + entityCount_; it++) {
+        if ((*it)->stateCached_)
+          markDirty((*it)->index_);
+      }
+    }
+
+    if (discoveryActive_ && !rediscoveryScheduled_) {
+      discoveryActive_ = false;
+      if (discoveryCallbackPtr_ != nullptr)
+        discoveryCallbackPtr_();
+    }
+  }
+
+  // Due heartbeats join the changed states, so they share the publish budget instead of bursting together
+  unsigned long now = millis();
+  for (auto it = entities_; it != entities_ + entityCount_; it++)
+    (*it)->serviceHeartbeat(now);
+
+  flushDirty(budget);
+
+  return MQTT::isConnected();
+}
+
+void MQTT_HASS::setDeferredPublishing(bool deferred) {
+  deferredPublishing_ = deferred;
+}
+
+bool MQTT_HASS::flush() {
+  int budget = INT_MAX;
+  return flushDirty(budget);
+}
+
+bool MQTT_HASS::flushDirty(int &budget) {
+  if (!MQTT::isConnected())
+    return false;
+
+  bool ok = true;
+  unsigned long now = millis();
+  for (int word = 0; word < BITMAP_WORDS; word++) {
+    uint32_t bits = dirty_[word];
+    while (bits != 0 && budget > 0) {
+      Entity *entity = entities_[word * 32 + __builtin_ctz(bits)];
+      bits &= bits - 1;
+      // The cache no longer holds the latest value, which was too long and has already been published
+      if (!entity->stateCached_) {
+        clearDirty(entity->index_);
+        continue;
+      }
+
+      // Values still held by a minimum interval stay dirty and don't use up the budget
+      if (!entity->flushDue(now))
+        continue;
+
+      budget--;
+      if (!entity->emitState())
+        ok = false;
+    }
+  }
+
+  return ok;
+}
+
+void MQTT_HASS::setRetainStates(bool retain) {
+  retainStates_ = retain;
+}
+
+bool MQTT_HASS::republishStates() {
+  bool ok = true;
+  for (auto it = entities_; it != entities_ + entityCount_; it++) {
+    Entity *entity = *it;
+    if (entity->stateCached_ && !entity->emitState())
+      ok = false;
+  }
+
+  return ok;
+}
+
+void MQTT_HASS::markDirty(int index) { setBit(dirty_, index); }
+void MQTT_HASS::clearDirty(int index) { clearBit(dirty_, index); }
+bool MQTT_HASS::isDirty(int index) { return testBit(dirty_, index); }
+
+void MQTT_HASS::setBit(uint32_t *bits, int index) {
+  if (index >= 0)
+    bits[index / 32] |= 1UL << (index % 32);
+}
+
+void MQTT_HASS::clearBit(uint32_t *bits, int index) {
+  if (index >= 0)
+    bits[index / 32] &= ~(1UL << (index % 32));
+}
+
+bool MQTT_HASS::testBit(uint32_t *bits, int index) {
+  return index >= 0 && (bits[index / 32] & (1UL << (index % 32))) != 0;
+}
+
+bool MQTT_HASS::publishAvailabilities() { return MQTT::publish(availabilityTopic_, "online", true); }
+
+void MQTT_HASS::addRoute(Entity *entity) {
+  // The table has room for twice the registry capacity, so it is at most half full and lookups rarely probe
+  int slot = entity->commandHash_ & (ROUTE_SLOTS - 1);
+  while (routes_[slot] != nullptr)
+    slot = (slot + 1) & (ROUTE_SLOTS - 1);
+  routes_[slot] = entity;
+}
+
+Entity *MQTT_HASS::findRoute(const char *topic) {
+  uint32_t hash = Utils::hash(topic);
+  for (int slot = hash & (ROUTE_SLOTS - 1); routes_[slot] != nullptr; slot = (slot + 1) & (ROUTE_SLOTS - 1)) {
+    Entity *entity = routes_[slot];
+    if (entity->commandHash_ == hash && entity->isCommandTopic(topic))
+      return entity;
+  }
+
+  return nullptr;
+}
+
 void MQTT_HASS::globalCallback(char *topic, uint8_t *payload, unsigned int length) {
-  String topic_str(topic);
-	char p[length + 1];
-	memcpy(p, payload, length);
-	p[length] = NULL;
-	String message(p);
-	
 	// If we're given the "birth" message we need to resend the config
-	if (topic_str == "homeassistant/status") {
-		if (message == "online") {
-			for (auto it = entities_.begin(); it != entities_.end(); it++) {
-				Entity *entity = *it;
-				entity->publishDiscovery();
-			}
-			publishAvailabilities();
-		}
-	} else {
-		for (auto it = entities_.begin(); it != entities_.end(); it++) {
-			Entity *entity = *it;
-			if (topic_str == entity->topicBase_ + "command" && entity->callbackPtr_ != nullptr)
-			entity->callbackPtr_(topic, payload, length);
-		}
+	if (strcmp(topic, "homeassistant/status") == 0) {
+		// loop() sends the discovery, availability and cached states, spread out by the jitter and publish budget
+		if (PayloadView(payload, length).equals("online"))
+			scheduleRediscovery();
+		return;
 	}
+
+	if (strcmp(topic, sessionTopic_) == 0) {
+		// The broker resumed our session, subscriptions and retained configs are still in place
+		if (sessionProbing_ && PayloadView(payload, length).equals(sessionNonce_))
+			sessionProbing_ = false;
+		return;
+	}
+
+	Entity *entity = findRoute(topic);
+	if (entity != nullptr)
+		entity->handleCommand(topic, payload, length);
 }
 
 void MQTT_HASS::init() {
@@ -83,188 +542,536 @@ void MQTT_HASS::globalCallbackWrapper(char *topic, uint8_t *payload, unsigned in
         instance_->globalCallback(topic, payload, length);
 }
 
-BinarySensor::BinarySensor(const String name, const String displayName, MQTT_HASS &client, Device dev, DeviceClasses deviceClasses)
-: Entity(client, dev, name, displayName) 
-, deviceClass_(deviceClasses) {
-  Entity::init("homeassistant/binary_sensor/particle_" + dev.name + "/" + name + "/");
+BinarySensor::BinarySensor(const String name, const String displayName, MQTT_HASS &client, const Device &dev, DeviceClasses deviceClasses)
+: Entity(client, dev, name, displayName) {
+  Entity::init("binary_sensor");
+  Entity::setSchema(schema);
+  if (deviceClasses != DeviceClasses::None)
+    Entity::deviceClass_ = deviceClasses2Str[deviceClasses];
 }
 
-bool BinarySensor::publishDiscovery() {
-  char payload[2048];
-  memset(payload, 0, sizeof(payload));
-  JSONBufferWriter writer(payload, sizeof(payload));
+// Name and schema tables are shared by every instance and live in flash
+constexpr Entity::DiscoveryField BinarySensor::schema[];
+constexpr const char* BinarySensor::states2Str[];
+constexpr const char* BinarySensor::deviceClasses2Str[];
+
+bool BinarySensor::publishDiscovery() { return Entity::publishEntityDiscovery(); }
+
+bool BinarySensor::publishAvailability() { return Entity::publishAvailability(); }
+bool BinarySensor::updateState(States val) { return Entity::publishState(states2Str[val]); }
+
+
+void Entity::init(const char *component, void (*callbackPtr)(char*, uint8_t*, unsigned int)) {
+  component_ = component;
+  callbackPtr_ = callbackPtr;
+  buildTopics();
+}
+
+void Entity::init(const char *component, void (*callbackPtr)(const char*, const PayloadView&)) {
+  payloadCallbackPtr_ = callbackPtr;
+  init(component);
+}
+
+void Entity::buildTopics() {
+  // All topics are built once here, so publishing and dispatching never concatenate strings
+  String base = "homeassistant/" + String(component_) + "/particle_" + dev_.name + "/" + name_ + "/";
+  baseLength_ = base.length();
+  deviceIdOffset_ = sizeof("homeassistant/") + strlen(component_);
+
+  size_t size = 2 * baseLength_ + sizeof("config") + sizeof("state");
+  if (hasCommand())
+    size += baseLength_ + sizeof("command");
+  // Room for "<serial>_<name>", filled in by uniqueId()
+  size += HAL_DEVICE_SERIAL_NUMBER_SIZE + 1 + name_.length() + 1;
+  topics_ = new char[size];
+
+  char *pos = topics_;
+  pos += snprintf(pos, size, "%sconfig", base.c_str()) + 1;
+  stateOffset_ = pos - topics_;
+  pos += snprintf(pos, size - stateOffset_, "%sstate", base.c_str()) + 1;
+  if (hasCommand()) {
+    commandOffset_ = pos - topics_;
+    pos += snprintf(pos, size - commandOffset_, "%scommand", base.c_str()) + 1;
+    commandHash_ = Utils::hash(commandTopic());
+  }
+  uniqueIdOffset_ = pos - topics_;
+  *pos = '\0';
+}
+
+void Entity::buildDeviceTopic() {
+  size_t size = sizeof("homeassistant/device/particle_/config") + dev_.name.length();
+  deviceTopic_ = new char[size];
+  snprintf(deviceTopic_, size, "homeassistant/device/particle_%s/config", dev_.name.c_str());
+}
+
+bool Entity::publishEntityDiscovery() {
+  JSONBufferWriter writer(client_.discoveryBuffer_, client_.discoveryCapacity(configTopic()));
 
   writer.beginObject();
-  writer.name("name").value(Entity::displayName_);
-  writer.name("state_topic").value(Entity::topicBase_ + "state");
-  writer.name("availability_topic").value(Entity::topicBase_ + "availability");
-  writer.name("unique_id").value(Utils::getSerialNum() + "_" + Entity::name_);
-  Entity::fillDeviceJSON(writer);
-  if (deviceClass_ != DeviceClasses::None)
-    writer.name("device_class").value(deviceClasses2Str[deviceClass_]);
+  fillTopicBaseJSON(writer);
+  fillDiscoveryJSON(writer);
+  // Home Assistant only needs the identifiers once the device exists, which the first entity's config creates
+  fillDeviceJSON(writer, !client_.deviceInfoOnce_ || client_.isFirstOfDevice(this));
   writer.endObject();
 
-  return Entity::publishDiscovery(payload);
+  return client_.publishConfig(this, configTopic(), writer);
 }
 
-bool BinarySensor::publishAvailability() { return Entity::publishAvailability(); }
-bool BinarySensor::updateState(States val) { return Entity::publishState(states2Str[val]); }
+bool Entity::hasCommand() { return callbackPtr_ != nullptr || payloadCallbackPtr_ != nullptr; }
 
+void Entity::handleCommand(char *topic, uint8_t *payload, unsigned int length) {
+  if (payloadCallbackPtr_ != nullptr)
+    payloadCallbackPtr_(topic, PayloadView(payload, length));
+  else
+    callbackPtr_(topic, payload, length);
+}
 
-void Entity::init(String topicBase, void (*callbackPtr)(char*, uint8_t*, unsigned int)) {
-  topicBase_ = topicBase;
-  callbackPtr_ = callbackPtr;
+bool Entity::isCommandTopic(const char *topic) { return hasCommand() && strcmp(topic, commandTopic()) == 0; }
+
+const char *Entity::uniqueId() {
+  // Entities are usually constructed before setup(), so the serial number is only read once the id is first needed
+  char *id = topics_ + uniqueIdOffset_;
+  if (*id == '\0')
+    snprintf(id, HAL_DEVICE_SERIAL_NUMBER_SIZE + 1 + name_.length() + 1, "%s_%s", Utils::serialNum(), name_.c_str());
+  return id;
 }
 
-bool Entity::publishDiscovery(const char *configJSON)
-{
-    if (!client_.publish(topicBase_ + "config", configJSON))
-        return false;
+void Entity::queueDiscovery() {
+  if (index_ >= 0)
+    client_.queueDiscovery(this);
+}
 
-    if (callbackPtr_ != nullptr)
-    {
-        if (!client_.subscribe(topicBase_ + "command"))
-            return false;
-    }
+bool Entity::publishAvailability() { return client_.publishAvailabilities(); }
+bool Entity::publishState(const String &state) { return publishState(state.c_str(), state.length()); }
+bool Entity::publishState(const char *state) { return publishState(state, strlen(state)); }
+bool Entity::publishState(const char *state, size_t length) { return reportState(state, length, false, 0); }
+
+void Entity::setReportingPolicy(const ReportingPolicy &policy) { policy_ = policy; }
+
+bool Entity::reportState(const char *state, size_t length, bool numeric, double number) {
+  bool changed = !stateCached_ || length != stateLength_ || memcmp(state_, state, length) != 0;
+
+  // Values too long for the cache bypass the policy and are always published straight away. An older value still
+  // held for the next flush must not be published after it.
+  stateCached_ = length <= sizeof(state_);
+  if (!stateCached_) {
+    client_.clearDirty(index_);
+    return client_.publish(stateTopic(), reinterpret_cast<const uint8_t*>(state), length, client_.retainStates_);
+  }
+
+  memcpy(state_, state, length);
+  stateLength_ = length;
+  stateNumeric_ = numeric;
+  stateNumber_ = number;
 
+  if (policy_.suppressDuplicates && !changed && !client_.isDirty(index_))
     return true;
+
+  if (numeric && withinDeadband(number)) {
+    client_.clearDirty(index_);
+    return true;
+  }
+
+  // Held values are published by the next flush(); several updates before then collapse into the latest.
+  // Entities that are not registered cannot be flushed, so they always publish straight away.
+  bool early = policy_.minInterval != 0 && reported_ && millis() - lastReport_ < policy_.minInterval;
+  if ((early || client_.deferredPublishing_) && index_ >= 0) {
+    client_.markDirty(index_);
+    return true;
+  }
+
+  return emitState();
+}
+
+bool Entity::withinDeadband(double number) {
+  if (!numberReported_)
+    return false;
+
+  double delta = fabs(number - reportedNumber_);
+  if (policy_.absoluteDeadband > 0 && delta < policy_.absoluteDeadband)
+    return true;
+
+  return policy_.relativeDeadband > 0 && delta < policy_.relativeDeadband * fabs(reportedNumber_);
+}
+
+bool Entity::emitState() {
+  if (!client_.publish(stateTopic(), reinterpret_cast<const uint8_t*>(state_), stateLength_, client_.retainStates_)) {
+    // Keep the value so flush() retries it once we are connected again
+    client_.markDirty(index_);
+    return false;
+  }
+
+  client_.clearDirty(index_);
+  reported_ = true;
+  lastReport_ = millis();
+  numberReported_ = stateNumeric_;
+  reportedNumber_ = stateNumber_;
+  return true;
+}
+
+bool Entity::flushDue(unsigned long now) { return !reported_ || now - lastReport_ >= policy_.minInterval; }
+
+void Entity::serviceHeartbeat(unsigned long now) {
+  if (policy_.heartbeat != 0 && stateCached_ && reported_ && now - lastReport_ >= policy_.heartbeat)
+    client_.markDirty(index_);
+}
+
+const char *Entity::key(const char *full, const char *abbreviated) {
+  return client_.compactDiscovery_ ? abbreviated : full;
+}
+
+void Entity::fillTopicBaseJSON(JSONBufferWriter &writer) {
+  if (client_.compactDiscovery_)
+    writer.name("~").value(topics_, baseLength_);
+}
+
+void Entity::fillTopicJSON(JSONBufferWriter &writer, const char *full, const char *abbreviated, const char *topic) {
+  if (!client_.compactDiscovery_) {
+    writer.name(full).value(topic);
+    return;
+  }
+
+  char value[16] = "~";
+  strncpy(value + 1, topic + baseLength_, sizeof(value) - 2);
+  writer.name(abbreviated).value(value);
+}
+
+void Entity::fillDiscoveryJSON(JSONBufferWriter &writer) {
+  for (uint8_t i = 0; i < schemaSize_; i++) {
+    const DiscoveryField &field = schema_[i];
+    switch (field.value) {
+      case DisplayName:
+        writer.name(key(field.full, field.abbreviated)).value(displayName_);
+        break;
+      case StateTopic:
+        fillTopicJSON(writer, field.full, field.abbreviated, stateTopic());
+        break;
+      case CommandTopic:
+        fillTopicJSON(writer, field.full, field.abbreviated, commandTopic());
+        break;
+      case AvailabilityTopic:
+        // Device-based discovery sets the availability topic once for all components
+        if (client_.discoveryMode_ == MQTT_HASS::DiscoveryModes::PerEntity)
+          writer.name(key(field.full, field.abbreviated)).value(client_.availabilityTopic_);
+        break;
+      case UniqueId:
+        writer.name(key(field.full, field.abbreviated)).value(uniqueId());
+        break;
+      case DeviceClass:
+        if (deviceClass_ != nullptr)
+          writer.name(key(field.full, field.abbreviated)).value(deviceClass_);
+        break;
+      default:
+        fillAttributeJSON(writer, key(field.full, field.abbreviated), field.value);
+        break;
+    }
+  }
 }
 
-bool Entity::publishAvailability() { return client_.publish(topicBase_ + "availability", "online"); }
-bool Entity::publishState(String state) { return client_.publish(topicBase_ + "state", state); }
+void Entity::fillAttributeJSON(JSONBufferWriter &writer, const char *key, DiscoveryValues value) {}
 
-void Entity::fillDeviceJSON(JSONBufferWriter &writer) {
-  writer.name("device").beginObject();
-    writer.name("identifiers").beginArray();
-        writer.name("particle_" + dev_.name);
+void Entity::fillDeviceJSON(JSONBufferWriter &writer, bool full) {
+  writer.name(key("device", "dev")).beginObject();
+    writer.name(key("identifiers", "ids")).beginArray();
+        writer.value(topics_ + deviceIdOffset_, sizeof("particle_") - 1 + dev_.name.length());
     writer.endArray();
-    writer.name("name").value(dev_.name);
-    writer.name("manufacturer").value(dev_.manufacturer);
-    writer.name("model").value(dev_.model);
-    writer.name("sw_version").value(dev_.swVersion);
+    if (full) {
+      writer.name("name").value(dev_.name);
+      writer.name(key("manufacturer", "mf")).value(dev_.manufacturer);
+      writer.name(key("model", "mdl")).value(dev_.model);
+      writer.name(key("sw_version", "sw")).value(dev_.swVersion);
+    }
   writer.endObject();
 }
 
-Sensor::Sensor(const String name, const String displayName, MQTT_HASS &client, Device dev, DeviceClasses deviceClass,
+Sensor::Sensor(const String name, const String displayName, MQTT_HASS &client, const Device &dev, DeviceClasses deviceClass,
                String unitOfMeasurement, EntityCategories entityCategory)
 : Entity(client, dev, name, displayName)
-, deviceClass_(deviceClass)
 , unitOfMeasurement_(unitOfMeasurement)
 , entityCategory_(entityCategory) {
-    Entity::init("homeassistant/sensor/particle_" + dev.name + "/" + name + "/");
+    Entity::init("sensor");
+    Entity::setSchema(schema);
+    if (deviceClass != DeviceClasses::None)
+      Entity::deviceClass_ = deviceClasses2Str[deviceClass];
 }
 
-bool Sensor::publishDiscovery() {
-  char payload[2048];
-  memset(payload, 0, sizeof(payload));
-  JSONBufferWriter writer(payload, sizeof(payload));
+constexpr Entity::DiscoveryField Sensor::schema[];
+constexpr const char* Sensor::deviceClasses2Str[];
+constexpr uint8_t Sensor::MAX_PRECISION;
+constexpr uint8_t Sensor::DEFAULT_PRECISION;
 
-  writer.beginObject();
-  writer.name("name").value(Entity::displayName_);
-  writer.name("state_topic").value(Entity::topicBase_ + "state");
-  writer.name("availability_topic").value(Entity::topicBase_ + "availability");
-  writer.name("unique_id").value(Utils::getSerialNum() + "_" + Entity::name_);
-  Entity::fillDeviceJSON(writer);
-  if (deviceClass_ != DeviceClasses::None)
-    writer.name("device_class").value(deviceClasses2Str[deviceClass_]);
-  if (unitOfMeasurement_ != "")
-    writer.name("unit_of_measurement").value(unitOfMeasurement_);
-  if (entityCategory_ == EntityCategories::diagnostic)
-    writer.name("entity_category").value("diagnostic");
-  writer.endObject();
+bool Sensor::publishDiscovery() { return Entity::publishEntityDiscovery(); }
 
-  return Entity::publishDiscovery(payload);
+void Sensor::fillAttributeJSON(JSONBufferWriter &writer, const char *key, DiscoveryValues value) {
+  switch (value) {
+    case UnitOfMeasurement:
+      if (unitOfMeasurement_ != "")
+        writer.name(key).value(unitOfMeasurement_);
+      break;
+    case EntityCategory:
+      if (entityCategory_ == EntityCategories::diagnostic)
+        writer.name(key).value("diagnostic");
+      break;
+    case DisplayPrecision:
+      if (precision_ >= 0)
+        writer.name(key).value((int)precision_);
+      break;
+    default:
+      break;
+  }
 }
 
 bool Sensor::publishAvailability() { return Entity::publishAvailability(); }
-bool Sensor::updateState(String val) {
-  Serial.println("I'm updating val to " + val);
-  return Entity::publishState(val); }
+bool Sensor::updateState(String val) { return Entity::publishState(val); }
+bool Sensor::updateState(const char *val) { return Entity::publishState(val); }
+bool Sensor::updateState(const char *val, size_t length) { return Entity::publishState(val, length); }
+bool Sensor::updateState(int val) { return publishNumber(val, 0, val); }
+bool Sensor::updateState(long val) { return publishNumber(val, 0, val); }
+bool Sensor::updateState(unsigned int val) { return publishNumber(val, 0, val); }
+bool Sensor::updateState(unsigned long val) { return publishNumber(val, 0, val); }
 
-Button::Button(const String name, const String displayName, MQTT_HASS &client, Device dev, void (*callbackPtr)(char*, uint8_t*, unsigned int), DeviceClasses deviceClass)
-: Entity(client, dev, name, displayName)
-, deviceClass_(deviceClass) {
-    Entity::init("homeassistant/button/particle_" + dev.name + "/" + name + "/", callbackPtr);
+// Floats are rounded to a scaled integer and printed with the fixed point formatter, which is much
+// cheaper than a generic float conversion
+static const float kPow10f[] = {1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f};
+static const double kPow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6};
+
+bool Sensor::updateState(float val) {
+  uint8_t decimals = precision_ < 0 ? DEFAULT_PRECISION : precision_;
+  float scaled = val * kPow10f[decimals];
+  // Also rejects NaN
+  if (!(scaled > -9.2e18f && scaled < 9.2e18f))
+    return false;
+
+  return publishNumber((int64_t)(scaled < 0 ? scaled - 0.5f : scaled + 0.5f), decimals, val);
 }
 
-bool Button::publishDiscovery() {
-  char payload[2048];
-  memset(payload, 0, sizeof(payload));
-  JSONBufferWriter writer(payload, sizeof(payload));
+bool Sensor::updateState(double val) {
+  uint8_t decimals = precision_ < 0 ? DEFAULT_PRECISION : precision_;
+  double scaled = val * kPow10[decimals];
+  if (!(scaled > -9.2e18 && scaled < 9.2e18))
+    return false;
 
-  writer.beginObject();
-  writer.name("name").value(Entity::displayName_);
-  writer.name("command_topic").value(Entity::topicBase_ + "command");
-  writer.name("availability_topic").value(Entity::topicBase_ + "availability");
-  writer.name("unique_id").value(Utils::getSerialNum() + "_" + Entity::name_);
-  Entity::fillDeviceJSON(writer);
-  if (deviceClass_ != DeviceClasses::None)
-    writer.name("device_class").value(deviceClasses2Str[deviceClass_]);
-  writer.endObject();
+  return publishNumber((int64_t)(scaled < 0 ? scaled - 0.5 : scaled + 0.5), decimals, val);
+}
+
+bool Sensor::updateStateFixed(int64_t val, uint8_t decimals) {
+  double number = val;
+  for (uint8_t i = 0; i < decimals; i++)
+    number /= 10;
 
-  return Entity::publishDiscovery(payload);
+  return publishNumber(val, decimals, number);
 }
 
-bool Button::publishAvailability() { return Entity::publishAvailability(); }
+bool Sensor::publishNumber(int64_t fixed, uint8_t decimals, double number) {
+  char buf[Utils::FIXED_BUFFER_SIZE];
+  size_t length = Utils::formatFixed(buf, fixed, decimals);
+  return Entity::reportState(buf, length, true, number);
+}
+
+void Sensor::setPrecision(uint8_t precision) {
+  if (precision > MAX_PRECISION)
+    precision = MAX_PRECISION;
+  if (precision == precision_)
+    return;
 
-Lock::Lock(const String name, const String displayName, MQTT_HASS &client, Device dev, void (*callbackPtr)(char *, uint8_t *, unsigned int))
+  precision_ = precision;
+  // The precision is part of the discovery payload, so Home Assistant has to be sent the config again
+  Entity::queueDiscovery();
+}
+
+Button::Button(const String name, const String displayName, MQTT_HASS &client, const Device &dev, void (*callbackPtr)(char*, uint8_t*, unsigned int), DeviceClasses deviceClass)
 : Entity(client, dev, name, displayName) {
-    Entity::init("homeassistant/lock/particle_" + dev.name + "/" + name + "/", callbackPtr);
+    Entity::init("button", callbackPtr);
+    Entity::setSchema(schema);
+    if (deviceClass != DeviceClasses::None)
+      Entity::deviceClass_ = deviceClasses2Str[deviceClass];
 }
 
-bool Lock::publishDiscovery() {
-  char payload[2048];
-  memset(payload, 0, sizeof(payload));
-  JSONBufferWriter writer(payload, sizeof(payload));
+constexpr Entity::DiscoveryField Button::schema[];
+constexpr const char* Button::deviceClasses2Str[];
 
-  writer.beginObject();
-  writer.name("name").value(Entity::displayName_);
-  writer.name("state_topic").value(Entity::topicBase_ + "state");
-  writer.name("command_topic").value(Entity::topicBase_ + "command");
-  writer.name("availability_topic").value(Entity::topicBase_ + "availability");
-  writer.name("unique_id").value(Utils::getSerialNum() + "_" + Entity::name_);
-  Entity::fillDeviceJSON(writer);
-  writer.endObject();
+bool Button::publishDiscovery() { return Entity::publishEntityDiscovery(); }
 
-  return Entity::publishDiscovery(payload);
+bool Button::publishAvailability() { return Entity::publishAvailability(); }
+
+Button::Button(const String name, const String displayName, MQTT_HASS &client, const Device &dev, void (*callbackPtr)(const char*, const PayloadView&), DeviceClasses deviceClass)
+: Entity(client, dev, name, displayName) {
+    Entity::init("button", callbackPtr);
+    Entity::setSchema(schema);
+    if (deviceClass != DeviceClasses::None)
+      Entity::deviceClass_ = deviceClasses2Str[deviceClass];
+}
+
+Lock::Lock(const String name, const String displayName, MQTT_HASS &client, const Device &dev, void (*callbackPtr)(char *, uint8_t *, unsigned int))
+: Entity(client, dev, name, displayName) {
+    Entity::init("lock", callbackPtr);
+    Entity::setSchema(schema);
 }
+
+Lock::Lock(const String name, const String displayName, MQTT_HASS &client, const Device &dev, void (*callbackPtr)(const char *, const PayloadView &))
+: Entity(client, dev, name, displayName) {
+    Entity::init("lock", callbackPtr);
+    Entity::setSchema(schema);
+}
+
+constexpr Entity::DiscoveryField Lock::schema[];
+constexpr const char* Lock::states2Str[];
+
+bool Lock::publishDiscovery() { return Entity::publishEntityDiscovery(); }
+
 bool Lock::publishAvailability() { return Entity::publishAvailability(); }
 bool Lock::updateState(States val) { return Entity::publishState(states2Str[val]); }
 
-Cover::Cover(const String name, const String displayName, MQTT_HASS &client, Device dev, void (*callbackPtr)(char *, uint8_t *, unsigned int),
+Cover::Cover(const String name, const String displayName, MQTT_HASS &client, const Device &dev, void (*callbackPtr)(char *, uint8_t *, unsigned int),
              DeviceClasses deviceClass)
-: Entity(client, dev, name, displayName)
-, deviceClass_(deviceClass) {
-    Entity::init("homeassistant/cover/particle_" + dev.name + "/" + name + "/", callbackPtr);
+: Entity(client, dev, name, displayName) {
+    Entity::init("cover", callbackPtr);
+    Entity::setSchema(schema);
+    if (deviceClass != DeviceClasses::None)
+      Entity::deviceClass_ = deviceClasses2Str[deviceClass];
 }
 
-bool Cover::publishDiscovery() {
-  char payload[2048];
-  memset(payload, 0, sizeof(payload));
-  JSONBufferWriter writer(payload, sizeof(payload));
+Cover::Cover(const String name, const String displayName, MQTT_HASS &client, const Device &dev, void (*callbackPtr)(const char *, const PayloadView &),
+             DeviceClasses deviceClass)
+: Entity(client, dev, name, displayName) {
+    Entity::init("cover", callbackPtr);
+    Entity::setSchema(schema);
+    if (deviceClass != DeviceClasses::None)
+      Entity::deviceClass_ = deviceClasses2Str[deviceClass];
+}
 
-  writer.beginObject();
-  writer.name("name").value(Entity::displayName_);
-  writer.name("state_topic").value(Entity::topicBase_ + "state");
-  writer.name("command_topic").value(Entity::topicBase_ + "command");
-  writer.name("availability_topic").value(Entity::topicBase_ + "availability");
-  writer.name("unique_id").value(Utils::getSerialNum() + "_" + Entity::name_);
-  Entity::fillDeviceJSON(writer);
-  if (deviceClass_ != DeviceClasses::None)
-    writer.name("device_class").value(deviceClasses2Str[deviceClass_]);
-  writer.endObject();
+constexpr Entity::DiscoveryField Cover::schema[];
+constexpr const char* Cover::states2Str[];
+constexpr const char* Cover::deviceClasses2Str[];
 
-  return Entity::publishDiscovery(payload);
-}
+bool Cover::publishDiscovery() { return Entity::publishEntityDiscovery(); }
 
 bool Cover::publishAvailability() { return Entity::publishAvailability(); }
 bool Cover::updateState(States val) { return Entity::publishState(states2Str[val]); }
 
-String Utils::getSerialNum()
+bool PayloadView::equals(const char *str) const {
+  return strlen(str) == length_ && memcmp(data_, str, length_) == 0;
+}
+
+bool PayloadView::toInt(long &val) const {
+  unsigned int i = 0;
+  bool negative = false;
+  if (i < length_ && (data_[i] == '-' || data_[i] == '+'))
+    negative = data_[i++] == '-';
+
+  if (i == length_)
+    return false;
+
+  // The magnitude is accumulated unsigned, so LONG_MIN's (one larger than LONG_MAX) can be represented too
+  unsigned long limit = negative ? (unsigned long)LONG_MAX + 1 : (unsigned long)LONG_MAX;
+  unsigned long result = 0;
+  for (; i < length_; i++) {
+    if (data_[i] < '0' || data_[i] > '9')
+      return false;
+    unsigned long digit = data_[i] - '0';
+    if (result > (limit - digit) / 10)
+      return false;
+    result = result * 10 + digit;
+  }
+
+  if (!negative || result == 0)
+    val = result;
+  else
+    val = -(long)(result - 1) - 1;
+  return true;
+}
+
+bool PayloadView::toFloat(float &val) const {
+  unsigned int i = 0;
+  bool negative = false;
+  if (i < length_ && (data_[i] == '-' || data_[i] == '+'))
+    negative = data_[i++] == '-';
+
+  float result = 0.0f;
+  float scale = 1.0f;
+  bool digits = false;
+  bool fraction = false;
+  for (; i < length_; i++) {
+    if (data_[i] == '.' && !fraction) {
+      fraction = true;
+      continue;
+    }
+    if (data_[i] < '0' || data_[i] > '9')
+      return false;
+
+    digits = true;
+    if (fraction) {
+      scale /= 10.0f;
+      result += (data_[i] - '0') * scale;
+    } else {
+      result = result * 10.0f + (data_[i] - '0');
+    }
+  }
+
+  if (!digits)
+    return false;
+
+  val = negative ? -result : result;
+  return true;
+}
+
+size_t PayloadView::copyTo(char *buf, size_t size) const {
+  if (size == 0)
+    return 0;
+
+  size_t len = length_ < size - 1 ? length_ : size - 1;
+  memcpy(buf, data_, len);
+  buf[len] = '\0';
+  return len;
+}
+
+uint32_t Utils::hash(const char *str)
 {
-  char serialNum[HAL_DEVICE_SERIAL_NUMBER_SIZE + 1];
-  memset(serialNum, 0, sizeof(serialNum));
-  hal_get_device_serial_number(serialNum, HAL_DEVICE_SERIAL_NUMBER_SIZE, nullptr);
+  // 32-bit FNV-1a
+  uint32_t hash = 2166136261u;
+  while (*str != '\0') {
+    hash ^= (uint8_t)*str++;
+    hash *= 16777619u;
+  }
 
-  return String(serialNum);
+  return hash;
 }
+
+size_t Utils::formatFixed(char *buf, int64_t value, uint8_t decimals)
+{
+  char digits[FIXED_BUFFER_SIZE];
+  uint64_t magnitude = value < 0 ? -(uint64_t)value : (uint64_t)value;
+  if (decimals > FIXED_BUFFER_SIZE - 4)
+    decimals = FIXED_BUFFER_SIZE - 4;
+
+  // Emit at least one digit before the decimal point
+  int count = 0;
+  do {
+    digits[count++] = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude != 0 || count <= decimals);
+
+  size_t length = 0;
+  if (value < 0)
+    buf[length++] = '-';
+  while (count > 0) {
+    if (count == decimals)
+      buf[length++] = '.';
+    buf[length++] = digits[--count];
+  }
+  buf[length] = '\0';
+
+  return length;
+}
+
+const char *Utils::serialNum()
+{
+  // Zero initialized, and the HAL never writes the last byte, so the number is always terminated
+  static char serialNum[HAL_DEVICE_SERIAL_NUMBER_SIZE + 1];
+  if (serialNum[0] == '\0')
+    hal_get_device_serial_number(serialNum, HAL_DEVICE_SERIAL_NUMBER_SIZE, nullptr);
+
+  return serialNum;
+}
+
+String Utils::getSerialNum() { return String(serialNum()); }
@@ -16,12 +16,22 @@
  *      global message callbacks, and integrates with Home Assistant through MQTT.
  *    - Provides two overloaded getInstance() methods accepting either a domain or an IP.
  *    - Exposes methods for connecting to the broker, registering entities, and publishing
- *      availability.
+ *      availability. All entities share one availability topic, which is backed by the MQTT Last Will.
+ *    - Supports per-entity discovery (one config message per entity) or device-based discovery
+ *      (one config message per device covering all of its entities).
+ *    - Config messages are retained and only resent when they change or Home Assistant restarts.
  *
  * 2. Device
  *    - A struct representing a device with essential information such as name, model,
  *      software version, and manufacturer.
  *
+ *    PayloadView
+ *    - A read-only view of an incoming MQTT payload handed to command callbacks without copying.
+ *
+ *    ReportingPolicy
+ *    - Controls when state updates are published (deadband, duplicate suppression, minimum interval
+ *      and heartbeat).
+ *
  * 3. BinarySensor
  *    - A subclass of Entity that represents a binary sensor (e.g., on/off).
  *    - Enumerates sensor states (OFF, ON) and a set of device classes for further classification.
@@ -57,10 +67,61 @@
 #include <MQTT.h>
 
 class Entity;
+
+// The sizing macros below change the layout of MQTT_HASS and Entity. MQTT_HASS.cpp is compiled on its own, so they
+// must be defined project wide (e.g. -D in the build flags). A #define in the application before including this
+// header only changes the application's view of the classes and silently corrupts memory.
+
+// Size (in bytes) of the MQTT packet buffer, which bounds every discovery message
+#ifndef MQTT_PACKET_SIZE
 #define MQTT_PACKET_SIZE 2048
+#endif
+
+// Longest state (in bytes) an entity keeps as its last value, longer states are published but not cached
+#ifndef MQTT_HASS_STATE_SIZE
+#define MQTT_HASS_STATE_SIZE 32
+#endif
+static_assert(MQTT_HASS_STATE_SIZE <= 255, "MQTT_HASS_STATE_SIZE must fit in a uint8_t");
+
+// Most entities one client can register. The registry is sized at compile time and never allocates, each slot costs
+// about 12 bytes of RAM whether it is used or not.
+#ifndef MQTT_HASS_MAX_ENTITIES
+#define MQTT_HASS_MAX_ENTITIES 128
+#endif
+static_assert(MQTT_HASS_MAX_ENTITIES > 0, "MQTT_HASS_MAX_ENTITIES must be positive");
+
+// Bounds (in ms) of the exponential backoff between the connection attempts made by loop()
+#ifndef MQTT_HASS_RECONNECT_MIN_DELAY
+#define MQTT_HASS_RECONNECT_MIN_DELAY 1000
+#endif
+#ifndef MQTT_HASS_RECONNECT_MAX_DELAY
+#define MQTT_HASS_RECONNECT_MAX_DELAY 60000
+#endif
+
+// How long (in ms) loop() waits for a resumed persistent session to echo the session probe
+#ifndef MQTT_HASS_SESSION_PROBE_TIMEOUT
+#define MQTT_HASS_SESSION_PROBE_TIMEOUT 2000
+#endif
 
 namespace Utils {
+  /** Buffer size that fits any value printed by formatFixed() */
+  constexpr size_t FIXED_BUFFER_SIZE = 24;
+
+  /** Smallest power of two that is at least n */
+  constexpr int powerOfTwoAtLeast(int n, int size = 1) { return size >= n ? size : powerOfTwoAtLeast(n, size * 2); }
+
+  /** Device serial number, read from the HAL once and cached for the rest of the boot */
+  const char *serialNum();
   String getSerialNum();
+  uint32_t hash(const char *str);
+
+  /**
+   * @brief Prints value / 10^decimals as a decimal number (e.g. 1234, 2 -> "12.34").
+   *
+   * @param buf The destination buffer, at least FIXED_BUFFER_SIZE bytes.
+   * @return The number of characters written, excluding the null terminator.
+   */
+  size_t formatFixed(char *buf, int64_t value, uint8_t decimals);
 }
 
 
@@ -82,15 +143,50 @@ namespace Utils {
  *       MQTT_HASS& instance = MQTT_HASS::getInstance(ip, port);
  *
  * Methods:
+ *   - begin: Stores the credentials and lets loop() connect and reconnect without blocking the application.
  *   - connect: Establishes a connection using provided username and password.
- *   - registerEntity: Registers an entity to be managed by Home Assistant.
- *   - publishAvailabilities: Publishes availability messages for all registered entities.
+ *   - connectionState: Reports the stage of the connection lifecycle.
+ *   - registerEntity: Registers an entity to be managed by Home Assistant. Its discovery is sent by loop().
+ *   - isDiscoveryComplete / onDiscoveryComplete: Report when all queued discovery messages have been sent.
+ *   - setDiscoveryMode: Chooses between per-entity and device-based discovery messages.
+ *   - publishAvailabilities: Publishes the availability message shared by all registered entities.
+ *   - setRediscoveryJitter: Delays rediscovery after a Home Assistant restart by a random time.
+ *   - setPublishBudget: Limits how many messages loop() publishes per call.
+ *   - setDeferredPublishing: Makes updateState() only record values, to be published together by flush().
+ *   - flush: Publishes the states of all entities that changed since the last flush.
+ *   - republishStates: Publishes the last state of every entity again (done automatically when Home Assistant
+ *                      comes online).
+ *   - setRetainStates: Publishes states as retained messages so the broker serves them to Home Assistant.
+ *   - setCleanSession: Keeps the broker session (subscriptions and queued commands) across reconnects.
+ *   - loop: Services the MQTT connection, sends any pending discovery messages, flushes changed
+ *           states and applies the entities' reporting policies.
  *
  * @note This design enforces a single point of MQTT communication, ensuring consistent state and behavior
  *       across the application.
  */
 class MQTT_HASS : public MQTT {
 public:
+  /**
+   * @brief Enumerates the ways discovery information can be sent to Home Assistant.
+   */
+  enum DiscoveryModes {
+    PerEntity, /**< One homeassistant/<component>/.../config message per entity */
+    PerDevice, /**< One homeassistant/device/<id>/config message per device with a components map */
+    __DISCOVERY_MODES_MAX,
+  };
+
+  /**
+   * @brief Enumerates the stages of the connection lifecycle run by loop().
+   */
+  enum ConnectionStates {
+    Disconnected, /**< Not connected and begin() has not been called */
+    Reconnecting, /**< Not connected, loop() retries after the backoff delay */
+    Resuming,     /**< Connected, waiting to learn whether the broker resumed our persistent session */
+    Discovering,  /**< Connected, discovery messages are still queued */
+    Online,       /**< Connected and discovery is complete */
+    __CONNECTION_STATES_MAX,
+  };
+
   MQTT_HASS() = delete;
 
   /**
@@ -129,7 +225,11 @@ public:
    * @brief Connects to the server using a username and password.
    *
    * This function attempts to establish a connection to a service with the
-   * provided authentication credentials.
+   * provided authentication credentials. The shared availability topic is registered as the
+   * MQTT Last Will with a retained "offline" message, and a retained "online" message is
+   * published once the connection is established. Command subscriptions are renewed with one
+   * wildcard per device, and the discovery of all registered entities is queued and replayed by
+   * loop(), so entities only need to be registered once.
    *
    * @param username A pointer to a null-terminated string representing the username.
    * @param password A pointer to a null-terminated string representing the password.
@@ -137,28 +237,211 @@ public:
    */
   bool connect(const char *username, const char *password);
 
+  /**
+   * @brief Stores the credentials and hands the connection lifecycle to loop().
+   *
+   * Instead of calling connect() from the application, loop() connects whenever the client is disconnected and
+   * retries failed attempts with a jittered exponential backoff between MQTT_HASS_RECONNECT_MIN_DELAY and
+   * MQTT_HASS_RECONNECT_MAX_DELAY ms. Calls to loop() made while waiting for the next attempt return immediately,
+   * so a broker outage does not stall the application.
+   *
+   * @note A connection attempt itself (DNS lookup and TCP connect) still blocks inside the MQTT library.
+   *
+   * @param username A pointer to a null-terminated string representing the username.
+   * @param password A pointer to a null-terminated string representing the password.
+   */
+  void begin(const char *username, const char *password);
+
+  /**
+   * @brief Reports the stage of the connection lifecycle.
+   *
+   * @return The current ConnectionStates value.
+   */
+  ConnectionStates connectionState();
+
   /**
    * @brief Registers an entity to be managed by Home Assistant.
    *
    * This function adds an entity to the list of managed entities by the MQTT_HASS instance.
    * The entity will be responsible for publishing discovery data and state updates.
    *
+   * Entities stay registered across reconnects and may be registered before connect() is called.
+   * Registering an entity that is already registered has no effect. At most MQTT_HASS_MAX_ENTITIES entities can be
+   * registered; raise it with a project wide -D (see the note above its definition) if more are needed.
+   *
+   * Registration does not block on the network: the entity's discovery message is queued and sent by loop(),
+   * at most setPublishBudget() messages per call. Use isDiscoveryComplete() or onDiscoveryComplete() to find out
+   * when all queued discovery messages have been sent.
+   *
    * @param entity A pointer to the entity object to be registered. (e.g. BinarySensor, Sensor, Button, etc)
    * @return true if the entity is successfully registered, false otherwise.
    */
   bool registerEntity(Entity *entity);
 
   /**
-   * @brief Publishes availability messages for all registered entities.
+   * @brief Reports whether all queued discovery messages have been sent.
    *
-   * This function iterates over all registered entities and publishes availability messages
-   * to indicate the current state of each entity.
-	 *
-	 * This function should be called on a regular basis (typically at least every 30 seconds)
+   * Entities registered while disconnected count as queued until loop() has sent their discovery after connecting.
+   * A config too large for an MQTT packet is logged and dropped, so it doesn't keep discovery from completing.
+   *
+   * @return true if no discovery messages are waiting to be sent by loop(), false otherwise.
+   */
+  bool isDiscoveryComplete();
+
+  /**
+   * @brief Sets a function called by loop() whenever the discovery queue has been fully sent.
+   *
+   * @param callbackPtr A pointer to the function to call, or nullptr to remove it.
+   */
+  void onDiscoveryComplete(void (*callbackPtr)());
+
+  /**
+   * @brief Selects how discovery information is sent to Home Assistant.
+   *
+   * In PerEntity mode (the default) every entity publishes its own config message.
+   * In PerDevice mode a single device-based discovery message is published for each device, listing all of
+   * its entities in a "components" map, so registering many entities results in a single publish.
+   *
+   * @note The device message must fit in MQTT_PACKET_SIZE, a device whose message doesn't is logged and skipped.
+   *       With the default 2048 bytes that is about 6 entities per device (8 with setCompactDiscovery(true)),
+   *       raise MQTT_PACKET_SIZE project wide for larger devices.
+   *
+   * @param mode The discovery mode to use. (default PerEntity)
+   */
+  void setDiscoveryMode(DiscoveryModes mode);
+
+  /**
+   * @brief Enables the compact discovery encoding.
+   *
+   * When enabled, discovery payloads use Home Assistant's abbreviated keys (e.g. "stat_t", "avty_t",
+   * "uniq_id", "dev", "unit_of_meas") and the "~" topic base substitution instead of repeating the full
+   * topic in every key. Home Assistant expands both before processing, so the resulting entities are
+   * identical; only the size of each discovery message changes (see README.md for a comparison).
+   *
+   * @param compact true to use the compact encoding, false for the verbose encoding. (default false)
+   */
+  void setCompactDiscovery(bool compact);
+
+  /**
+   * @brief Sends the full device information only once per device.
+   *
+   * When enabled in PerEntity discovery mode, only the first registered entity of each Device carries the full
+   * device block (name, manufacturer, model, sw_version). All other entities of that device only send its
+   * identifiers, which is all Home Assistant needs to attach them to the existing device.
+   *
+   * @param once true to send the full device block once per device, false to send it with every entity. (default false)
+   */
+  void setDeviceInfoOnce(bool once);
+
+  /**
+   * @brief Publishes the discovery messages for all registered entities.
+   *
+   * Discovery is normally queued and sent incrementally by loop(), skipping configs that are unchanged since they
+   * were last sent. This publishes every config immediately instead.
+   *
+   * @return true if all discovery messages are successfully published, false otherwise.
+   */
+  bool publishDiscoveries();
+
+  /**
+   * @brief Services the MQTT connection.
+   *
+   * Reconnects with backoff if begin() was called, processes incoming messages and sends any queued discovery
+   * messages (device-based discovery and rediscovery after Home Assistant restarts). It then publishes changed states
+   * (including those held back by a ReportingPolicy minimum interval) and due heartbeats. Discovery, availability,
+   * state and heartbeat messages are all limited by the publish budget, whatever doesn't fit is sent by the next calls.
+   * This should be called on every iteration of the application loop.
+   *
+   * @return true if the client is still connected, false otherwise.
+   */
+  bool loop();
+
+  /**
+   * @brief Defers state publishing to flush().
+   *
+   * When enabled, updateState() only records the new value in the entity and marks it as changed. The next
+   * flush() (called by loop()) publishes all changed entities in one batch, so sampling many sensors does not
+   * block on one network write per sensor. Several updates of one entity between flushes collapse into the
+   * latest value.
+   *
+   * @note Entities that are not registered always publish immediately.
+   *
+   * @param deferred true to defer publishing to flush(), false to publish on every updateState(). (default false)
+   */
+  void setDeferredPublishing(bool deferred);
+
+  /**
+   * @brief Sets the maximum random delay before rediscovery when Home Assistant comes online.
+   *
+   * Every device receives Home Assistant's "online" birth message at the same moment. Instead of answering
+   * immediately, loop() waits a random time between 0 and maxDelay before sending discovery, availability and
+   * the cached states again, so a fleet of devices spreads its rediscovery over that window.
+   *
+   * @param maxDelay The maximum delay in ms. (default 0, rediscover on the next loop())
+   */
+  void setRediscoveryJitter(uint32_t maxDelay);
+
+  /**
+   * @brief Limits the number of discovery, availability and state messages loop() publishes per call.
+   *
+   * @param budget The maximum number of messages per loop() call. (default 0, unlimited)
+   */
+  void setPublishBudget(uint16_t budget);
+
+  /**
+   * @brief Publishes the state of every entity that changed since it was last published.
+   *
+   * This is called automatically by loop().
+   *
+   * @return true if all changed states are successfully published (or still held by a minimum interval), false otherwise.
+   */
+  bool flush();
+
+  /**
+   * @brief Publishes the last known state of every registered entity.
+   *
+   * When Home Assistant sends its "online" birth message, loop() republishes the cached states automatically right
+   * after rediscovery, so entities don't show as "unknown" until their state next changes. This function publishes
+   * them immediately instead.
+   *
+   * @note Only states that fit in MQTT_HASS_STATE_SIZE are kept and republished.
+   *
+   * @return true if all states are successfully published, false otherwise.
+   */
+  bool republishStates();
+
+  /**
+   * @brief Publishes states as retained messages.
+   *
+   * With retained states the broker keeps the last state of every entity and hands it to Home Assistant
+   * whenever it subscribes, without any action from the device.
+   *
+   * @param retain true to retain state messages, false otherwise. (default false)
+   */
+  void setRetainStates(bool retain);
+
+  /**
+   * @brief Chooses whether connect() starts a clean MQTT session.
+   *
+   * The client ID is stable ("particle" followed by the device serial number), so with a persistent session the
+   * broker keeps our subscriptions and queues commands sent while the device is offline. On reconnect a nonce is
+   * published to the device's session topic: if the broker echoes it back the session was resumed and
+   * re-subscribing is skipped, otherwise loop() re-subscribes after MQTT_HASS_SESSION_PROBE_TIMEOUT ms.
+   *
+   * @param clean true to start a new session on every connect, false to resume the previous one. (default true)
+   */
+  void setCleanSession(bool clean);
+
+  /**
+   * @brief Publishes the availability message for all registered entities.
+   *
+   * All entities reference a single retained availability topic, so this publishes one "online" message.
+   * The broker publishes "offline" through the Last Will when the connection drops.
 	 *
-	 * @note This function is typically called after registering all entities to ensure availability messages are sent.
+	 * @note This is called automatically by connect() and when Home Assistant comes online, so it does not
+	 *       need to be called periodically.
    *
-   * @return true if all availability messages are successfully published, false otherwise.
+   * @return true if the availability message is successfully published, false otherwise.
    */
   bool publishAvailabilities();
 
@@ -171,9 +454,73 @@ private:
   MQTT_HASS(const char *domain, uint16_t port);
   MQTT_HASS(const uint8_t *ip, uint16_t port);
   ~MQTT_HASS();
-  Vector<Entity*> entities_;
+  static constexpr int BITMAP_WORDS = (MQTT_HASS_MAX_ENTITIES + 31) / 32;
+  // Keeps the route table at most half full
+  static constexpr int ROUTE_SLOTS = Utils::powerOfTwoAtLeast(2 * MQTT_HASS_MAX_ENTITIES);
+
+  Entity *entities_[MQTT_HASS_MAX_ENTITIES];
+  int entityCount_ = 0;
+  Entity *routes_[ROUTE_SLOTS] = {};          // Open addressing table of command entities, keyed by commandHash_
+  uint32_t dirty_[BITMAP_WORDS] = {};          // One bit per registered entity whose state still has to be published
+  uint32_t discoveryQueue_[BITMAP_WORDS] = {}; // One bit per registered entity whose discovery still has to be published
+  // Fixed header (up to 5 bytes) and topic length prefix of a PUBLISH packet
+  static constexpr size_t PUBLISH_HEADER_SIZE = 7;
+  // Discovery payloads are serialized here one at a time, then copied into the MQTT library's packet buffer
+  char discoveryBuffer_[MQTT_PACKET_SIZE];
+  String availabilityTopic_;
+  String sessionTopic_;
+  String sessionNonce_;
+  String clientId_;
+  String username_;
+  String password_;
+  friend class Entity;
+
+  DiscoveryModes discoveryMode_ = DiscoveryModes::PerEntity;
+  bool compactDiscovery_ = false;
+  bool deviceInfoOnce_ = false;
+  bool deferredPublishing_ = false;
+  bool retainStates_ = false;
+  bool cleanSession_ = true;
+  bool autoConnect_ = false;
+  uint32_t backoff_ = 0;
+  uint32_t retryDelay_ = 0;
+  unsigned long lastAttempt_ = 0;
+  bool sessionEstablished_ = false;
+  bool sessionProbing_ = false;
+  unsigned long sessionProbeAt_ = 0;
+  uint32_t rediscoveryJitter_ = 0;
+  uint16_t publishBudget_ = 0;
+  bool rediscoveryScheduled_ = false;
+  unsigned long rediscoveryAt_ = 0;
+  bool discoveryActive_ = false;
+  bool configTooLarge_ = false;  // Set by publishConfig() when a payload can't fit in an MQTT packet
+  bool configSent_ = false;  // Set by publishConfig() when a payload actually went out
+  void (*discoveryCallbackPtr_)() = nullptr;
 
   void init();
+  bool startSession();
+  bool reconnect();
+  bool isFirstOfDevice(Entity *entity);
+  bool isFirstCommandOfDevice(Entity *entity);
+  bool subscribeCommands(Entity *entity);
+  void addRoute(Entity *entity);
+  Entity *findRoute(const char *topic);
+  void queueDiscovery(Entity *entity);
+  void queueAllDiscovery();
+  size_t discoveryCapacity(const char *topic);
+  bool publishConfig(Entity *owner, const char *topic, JSONBufferWriter &writer);
+  void forgetDiscoveries();
+  bool publishQueuedDiscovery(int &budget);
+  bool isDiscoveryQueued();
+  void scheduleRediscovery();
+  bool flushDirty(int &budget);
+  void markDirty(int index);
+  void clearDirty(int index);
+  bool isDirty(int index);
+  static void setBit(uint32_t *bits, int index);
+  static void clearBit(uint32_t *bits, int index);
+  static bool testBit(uint32_t *bits, int index);
+  bool publishDeviceDiscovery(Entity *first);
 
   static MQTT_HASS *instance_;
   static void globalCallbackWrapper(char* topic, uint8_t* payload, unsigned int length);
@@ -183,6 +530,10 @@ private:
  * @brief Struct representing a device.
  *
  * This struct holds information about a device, including its name, model, and unique identifier.
+ *
+ * @note Entities keep a reference to the Device they are constructed with instead of a copy, so the Device
+ *       must outlive them (e.g. a global) and must not be modified once its entities are registered. Passing a
+ *       temporary Device to an entity constructor does not compile.
  */
 typedef struct {
   String name;                                /**< The name of the device. (DO NOT USE ANY SPACES) */
@@ -191,33 +542,207 @@ typedef struct {
   String manufacturer = "Particle MQTT_HASS"; /**< The manufacturer of the device. */
 } Device;
 
+/**
+ * @brief Struct controlling when an entity's state updates are published.
+ *
+ * The entity keeps the last value passed to updateState() and decides from this policy whether to publish it.
+ * A default constructed policy publishes every update, which is the behavior without a policy.
+ */
+typedef struct {
+  float absoluteDeadband = 0;       /**< Numeric updates closer than this to the last published value are not published. (0 = off) */
+  float relativeDeadband = 0;       /**< Same as absoluteDeadband, as a fraction of the last published value (e.g. 0.05 = 5%). (0 = off) */
+  bool suppressDuplicates = false;  /**< Updates identical to the last value (strings, enums) are not published. */
+  uint32_t minInterval = 0;         /**< Minimum time between two publishes in ms. Updates in between are held and the latest is published by flush(). */
+  uint32_t heartbeat = 0;           /**< The last value is republished by loop() if nothing was published for this many ms. (0 = off) */
+} ReportingPolicy;
+
+/**
+ * @class PayloadView
+ * @brief Read-only view of an incoming MQTT payload.
+ *
+ * The payload is not copied or null terminated; the view points straight into the MQTT receive buffer
+ * and is only valid for the duration of the callback it is passed to.
+ *
+ * Usage:
+ * - Compare against expected commands with equals() (e.g. payload.equals("OPEN")).
+ * - Parse numeric commands with toInt() or toFloat().
+ * - Use copyTo() if the payload has to outlive the callback.
+ */
+class PayloadView {
+public:
+  PayloadView(const uint8_t *data, unsigned int length)
+  : data_(reinterpret_cast<const char*>(data))
+  , length_(length)
+  {}
+
+  /**
+   * @return A pointer to the first byte of the payload. (NOT null terminated)
+   */
+  const char *data() const { return data_; }
+
+  /**
+   * @return The number of bytes in the payload.
+   */
+  unsigned int length() const { return length_; }
+
+  /**
+   * @brief Compares the payload with a null terminated string.
+   *
+   * @param str The string to compare against.
+   * @return true if the payload and the string are identical, false otherwise.
+   */
+  bool equals(const char *str) const;
+
+  /**
+   * @brief Parses the payload as a decimal integer with an optional sign.
+   *
+   * @param val Receives the parsed value. It is left untouched if parsing fails.
+   * @return true if the whole payload is a valid integer, false otherwise.
+   */
+  bool toInt(long &val) const;
+
+  /**
+   * @brief Parses the payload as a decimal number with an optional sign and fraction (e.g. "-12.5").
+   *
+   * @param val Receives the parsed value. It is left untouched if parsing fails.
+   * @return true if the whole payload is a valid number, false otherwise.
+   */
+  bool toFloat(float &val) const;
+
+  /**
+   * @brief Copies the payload into a buffer and null terminates it.
+   *
+   * @param buf The destination buffer.
+   * @param size The size of the destination buffer. The payload is truncated to size - 1 bytes if needed.
+   * @return The number of payload bytes copied.
+   */
+  size_t copyTo(char *buf, size_t size) const;
+
+private:
+  const char *data_;
+  unsigned int length_;
+};
+
 /**
  * @private
  */
 class Entity {
 public:
-  String topicBase_;
-  void (*callbackPtr_)(char*, uint8_t*, unsigned int);
+  void (*callbackPtr_)(char*, uint8_t*, unsigned int) = nullptr;
+  void (*payloadCallbackPtr_)(const char*, const PayloadView&) = nullptr;
   virtual bool publishDiscovery() = 0;
   bool publishAvailability();
 
+  /**
+   * @brief Sets the policy that decides which state updates are published.
+   *
+   * @note States longer than MQTT_HASS_STATE_SIZE are not cached and are always published.
+   *
+   * @param policy The reporting policy, copied into the entity.
+   */
+  void setReportingPolicy(const ReportingPolicy &policy);
+
 protected:
+  /**
+   * @brief Enumerates the values a discovery schema field can write.
+   */
+  enum DiscoveryValues {
+    DisplayName,       /**< The entity's display name */
+    StateTopic,        /**< The state topic */
+    CommandTopic,      /**< The command topic */
+    AvailabilityTopic, /**< The shared availability topic, omitted in device-based discovery */
+    UniqueId,          /**< The unique id derived from the serial number and entity name */
+    DeviceClass,       /**< The device class, omitted if None */
+    UnitOfMeasurement, /**< Written by fillAttributeJSON() */
+    EntityCategory,    /**< Written by fillAttributeJSON() */
+    DisplayPrecision,  /**< Written by fillAttributeJSON() */
+    __DISCOVERY_VALUES_MAX,
+  };
+
+  /**
+   * @brief One key of a component's discovery payload.
+   *
+   * Every entity type lists its keys in a constexpr schema table, which fillDiscoveryJSON() walks in order.
+   */
+  typedef struct {
+    const char *full;         // Key in verbose discovery payloads
+    const char *abbreviated;  // Key used by compact discovery
+    DiscoveryValues value;
+  } DiscoveryField;
 
   Entity() = delete;
-  Entity(MQTT_HASS &client, Device dev, String name, String displayName)
+  Entity(MQTT_HASS &client, const Device &dev, String name, String displayName)
   : client_(client)
   , dev_(dev)
   , name_(name)
   , displayName_(displayName)
   {}
-
-  void init(String topicBase, void (*callbackPtr)(char*, uint8_t*, unsigned int) = nullptr);
-  bool publishDiscovery(const char *config);
-  bool publishState(String state);
-  void fillDeviceJSON(JSONBufferWriter &writer);
+  Entity(const Entity&) = delete;
+  Entity& operator=(const Entity&) = delete;
+  virtual ~Entity() { delete[] topics_; delete[] deviceTopic_; }
+
+  void init(const char *component, void (*callbackPtr)(char*, uint8_t*, unsigned int) = nullptr);
+  void init(const char *component, void (*callbackPtr)(const char*, const PayloadView&));
+  template <size_t N>
+  void setSchema(const DiscoveryField (&schema)[N]) {
+    schema_ = schema;
+    schemaSize_ = N;
+  }
+  void buildTopics();
+  void buildDeviceTopic();
+  const char *configTopic() { return topics_; }
+  const char *stateTopic() { return topics_ + stateOffset_; }
+  const char *commandTopic() { return topics_ + commandOffset_; }
+  bool publishEntityDiscovery();
+  void queueDiscovery();
+  bool hasCommand();
+  void handleCommand(char *topic, uint8_t *payload, unsigned int length);
+  bool isCommandTopic(const char *topic);
+  bool publishState(const String &state);
+  bool publishState(const char *state);
+  bool publishState(const char *state, size_t length);
+  bool reportState(const char *state, size_t length, bool numeric, double number);
+  bool withinDeadband(double number);
+  bool emitState();
+  bool flushDue(unsigned long now);
+  void serviceHeartbeat(unsigned long now);
+  const char *uniqueId();
+  const char *key(const char *full, const char *abbreviated);
+  void fillTopicBaseJSON(JSONBufferWriter &writer);
+  void fillTopicJSON(JSONBufferWriter &writer, const char *full, const char *abbreviated, const char *topic);
+  void fillDeviceJSON(JSONBufferWriter &writer, bool full);
+  void fillDiscoveryJSON(JSONBufferWriter &writer);
+  virtual void fillAttributeJSON(JSONBufferWriter &writer, const char *key, DiscoveryValues value);
+
+  friend class MQTT_HASS;
 
   MQTT_HASS &client_;
-  Device dev_;
+  const char *component_;
+  const DiscoveryField *schema_ = nullptr;
+  uint8_t schemaSize_ = 0;
+  const char *deviceClass_ = nullptr;  // Device class name, nullptr for None
+  int index_ = -1;  // Position in the registry, -1 while not registered
+  uint32_t commandHash_ = 0;
+  char *topics_ = nullptr;  // "<base>config\0<base>state\0[<base>command\0]<serial>_<name>\0"
+  uint16_t baseLength_ = 0;
+  uint16_t stateOffset_ = 0;
+  uint16_t commandOffset_ = 0;
+  uint16_t uniqueIdOffset_ = 0;
+  uint16_t deviceIdOffset_ = 0;  // "particle_<device>" inside the base of the topics
+  char *deviceTopic_ = nullptr;  // Device-based discovery topic, only built for the first entity of each device
+
+  ReportingPolicy policy_;
+  char state_[MQTT_HASS_STATE_SIZE];  // Last value passed to updateState(), NOT null terminated
+  uint8_t stateLength_ = 0;
+  bool stateCached_ = false;
+  bool stateNumeric_ = false;
+  bool reported_ = false;
+  bool numberReported_ = false;
+  double stateNumber_ = 0;
+  double reportedNumber_ = 0;
+  unsigned long lastReport_ = 0;
+  uint32_t discoveryHash_ = 0;  // Hash of the last config published for this entity (or its device), 0 if none
+  const Device &dev_;
   String name_;
   String displayName_;
 };
@@ -299,7 +824,9 @@ public:
    * @param dev The device information for the sensor.
    * @param deviceClass The device class for the sensor. (default: None)
    */
-  BinarySensor(const String name, const String displayName, MQTT_HASS &client, Device dev, DeviceClasses deviceClass = DeviceClasses::None);
+  BinarySensor(const String name, const String displayName, MQTT_HASS &client, const Device &dev, DeviceClasses deviceClass = DeviceClasses::None);
+  /** Entities keep a reference to their Device, so a temporary one is rejected */
+  BinarySensor(const String name, const String displayName, MQTT_HASS &client, Device &&dev, DeviceClasses deviceClass = DeviceClasses::None) = delete;
 
   /**
    * @brief Publishes the discovery message for the binary sensor.
@@ -308,7 +835,7 @@ public:
    * The message includes the sensor's name, state topic, availability topic, unique ID, device information,
    * and device class (if applicable).
    *
-   * @note this is called automatically for you when you register the entity and does not need to be called manually.
+   * @note this is called automatically for you by loop() after you register the entity and does not need to be called manually.
    *
    * @return true if the discovery message is successfully published, false otherwise.
    */
@@ -318,9 +845,9 @@ public:
    * @brief (Optionally) Publishes the availability message for the binary sensor.
    *
    * This method publishes an availability message for the binary sensor to indicate its current state.
-   * The message is sent to the availability topic of the sensor.
+   * The message is sent to the availability topic shared by all entities of this client.
    *
-   * @note this is called automatically for you when you register the entity and call publishAvailabilities().
+   * @note this is called automatically for you when you connect and does not need to be called manually.
    *
    * @return true if the availability message is successfully published, false otherwise.
    */
@@ -338,14 +865,20 @@ public:
   bool updateState(States val);
 
 private:
-  DeviceClasses deviceClass_;
+  static constexpr DiscoveryField schema[] = {
+    {"name",               "name",    DisplayName},
+    {"state_topic",        "stat_t",  StateTopic},
+    {"availability_topic", "avty_t",  AvailabilityTopic},
+    {"unique_id",          "uniq_id", UniqueId},
+    {"device_class",       "dev_cla", DeviceClass},
+  };
 
-  const char* states2Str[__STATES_MAX] = {
+  static constexpr const char* states2Str[__STATES_MAX] = {
     "OFF",
     "ON",
   };
 
-  const char* deviceClasses2Str[__DEVICE_CLASSES_MAX] = {
+  static constexpr const char* deviceClasses2Str[__DEVICE_CLASSES_MAX] = {
     "None",
     "battery",
     "battery_charging",
@@ -489,13 +1022,16 @@ public:
 	 *
 	 * @return A Sensor object with the specified parameters.
 	 */
-  Sensor(const String name, const String displayName, MQTT_HASS &client, Device dev, DeviceClasses deviceClass = DeviceClasses::None,
+  Sensor(const String name, const String displayName, MQTT_HASS &client, const Device &dev, DeviceClasses deviceClass = DeviceClasses::None,
          String unitOfMeasurement = "", EntityCategories entityCategory = EntityCategories::normal);
+  /** Entities keep a reference to their Device, so a temporary one is rejected */
+  Sensor(const String name, const String displayName, MQTT_HASS &client, Device &&dev, DeviceClasses deviceClass = DeviceClasses::None,
+         String unitOfMeasurement = "", EntityCategories entityCategory = EntityCategories::normal) = delete;
 
 	/**
 	 * @brief Publishes the discovery message for the sensor.
 	 *
-	 * @note this is called automatically for you when you register the entity and does not need to be called manually.
+	 * @note this is called automatically for you by loop() after you register the entity and does not need to be called manually.
 	 *
 	 * @return true if the discovery message is successfully published, false otherwise.
 	 */
@@ -504,7 +1040,7 @@ public:
 	/**
 	 * @brief Publishes the availability message for the sensor.
 	 *
-	 * @note this is called automatically for you when you register the entity and call publishAvailabilities().
+	 * @note this is called automatically for you when you connect and does not need to be called manually.
 	 *
 	 * @return true if the availability message is successfully published, false otherwise.
 	 */
@@ -521,12 +1057,93 @@ public:
 	 */
   bool updateState(String val);
 
+	/**
+	 * @brief Updates the state of the sensor without allocating.
+	 *
+	 * @param val The new state of the sensor as a null terminated string.
+	 * @return true if the state is successfully updated, false otherwise.
+	 */
+  bool updateState(const char *val);
+
+	/**
+	 * @brief Updates the state of the sensor from a buffer without allocating.
+	 *
+	 * @param val The new state of the sensor. (does not need to be null terminated)
+	 * @param length The number of bytes in val.
+	 * @return true if the state is successfully updated, false otherwise.
+	 */
+  bool updateState(const char *val, size_t length);
+
+	/**
+	 * @brief Updates the state of the sensor with an integer value.
+	 *
+	 * The value is formatted into a stack buffer; no heap allocation takes place.
+	 *
+	 * @param val The new state of the sensor.
+	 * @return true if the state is successfully updated, false otherwise.
+	 */
+  bool updateState(int val);
+  bool updateState(long val);
+  bool updateState(unsigned int val);
+  bool updateState(unsigned long val);
+
+	/**
+	 * @brief Updates the state of the sensor with a floating point value.
+	 *
+	 * The value is rounded to the precision set with setPrecision() (2 decimals if none was set) and
+	 * formatted into a stack buffer; no heap allocation takes place.
+	 *
+	 * @param val The new state of the sensor.
+	 * @return true if the state is successfully updated, false otherwise (including NaN or out of range values).
+	 */
+  bool updateState(float val);
+  bool updateState(double val);
+
+	/**
+	 * @brief Updates the state of the sensor with a fixed point value.
+	 *
+	 * The published value is val / 10^decimals, e.g. updateStateFixed(2315, 2) publishes "23.15".
+	 *
+	 * @param val The new state of the sensor, scaled by 10^decimals.
+	 * @param decimals The number of decimal places in val.
+	 * @return true if the state is successfully updated, false otherwise.
+	 */
+  bool updateStateFixed(int64_t val, uint8_t decimals);
+
+	/**
+	 * @brief Sets the number of decimals used for floating point states.
+	 *
+	 * The precision is also sent to Home Assistant as suggested_display_precision. Changing it once the sensor is
+	 * registered queues its discovery message again, loop() sends it.
+	 *
+	 * @param precision The number of decimals, up to MAX_PRECISION.
+	 */
+  void setPrecision(uint8_t precision);
+
+  static constexpr uint8_t MAX_PRECISION = 6;
+
 private:
-  DeviceClasses deviceClass_;
   String unitOfMeasurement_;
   EntityCategories entityCategory_;
+  int8_t precision_ = -1;
+
+  static constexpr uint8_t DEFAULT_PRECISION = 2;
+
+  static constexpr DiscoveryField schema[] = {
+    {"name",                        "name",         DisplayName},
+    {"state_topic",                 "stat_t",       StateTopic},
+    {"availability_topic",          "avty_t",       AvailabilityTopic},
+    {"unique_id",                   "uniq_id",      UniqueId},
+    {"device_class",                "dev_cla",      DeviceClass},
+    {"unit_of_measurement",         "unit_of_meas", UnitOfMeasurement},
+    {"entity_category",             "ent_cat",      EntityCategory},
+    {"suggested_display_precision", "sug_dsp_prc",  DisplayPrecision},
+  };
+
+  void fillAttributeJSON(JSONBufferWriter &writer, const char *key, DiscoveryValues value);
+  bool publishNumber(int64_t fixed, uint8_t decimals, double number);
 
-  const char* deviceClasses2Str[__DEVICE_CLASSES_MAX] = {
+  static constexpr const char* deviceClasses2Str[__DEVICE_CLASSES_MAX] = {
     "None",
     "apparent_power",
     "aqi",
@@ -620,13 +1237,33 @@ public:
 	 *
 	 * @return A Button object with the specified parameters.
 	 */
-  Button(const String name, const String displayName, MQTT_HASS &client, Device dev, void (*callbackPtr)(char*, uint8_t*, unsigned int),
+  Button(const String name, const String displayName, MQTT_HASS &client, const Device &dev, void (*callbackPtr)(char*, uint8_t*, unsigned int),
+         DeviceClasses deviceClass = DeviceClasses::None);
+
+	/**
+	 * @brief Constructs a Button object whose callback receives the payload as a PayloadView.
+	 *
+	 * @param name The name of the button. (DO NOT USE ANY SPACES)
+	 * @param displayName The display name of the button.
+	 * @param client A reference to the MQTT_HASS instance.
+	 * @param dev The device information for the button.
+	 * @param callbackPtr A pointer to the callback function for handling button actions.
+	 * @param deviceClass The device class for the button. (default None)
+	 *
+	 * @return A Button object with the specified parameters.
+	 */
+  Button(const String name, const String displayName, MQTT_HASS &client, const Device &dev, void (*callbackPtr)(const char*, const PayloadView&),
          DeviceClasses deviceClass = DeviceClasses::None);
+  /** Entities keep a reference to their Device, so a temporary one is rejected */
+  Button(const String name, const String displayName, MQTT_HASS &client, Device &&dev, void (*callbackPtr)(char*, uint8_t*, unsigned int),
+         DeviceClasses deviceClass = DeviceClasses::None) = delete;
+  Button(const String name, const String displayName, MQTT_HASS &client, Device &&dev, void (*callbackPtr)(const char*, const PayloadView&),
+         DeviceClasses deviceClass = DeviceClasses::None) = delete;
 
 	/**
 	 * @brief Publishes the discovery message for the button.
 	 *
-	 * @note this is called automatically for you when you register the entity and does not need to be called manually.
+	 * @note this is called automatically for you by loop() after you register the entity and does not need to be called manually.
 	 *
 	 * @return true if the discovery message is successfully published, false otherwise.
 	 */
@@ -635,16 +1272,22 @@ public:
 	/**
 	 * @brief Publishes the availability message for the button.
 	 *
-	 * @note this is called automatically for you when you register the entity and call publishAvailabilities().
+	 * @note this is called automatically for you when you connect and does not need to be called manually.
 	 *
 	 * @return true if the availability message is successfully published, false otherwise.
 	 */
   bool publishAvailability();
 
 private:
-  DeviceClasses deviceClass_;
+  static constexpr DiscoveryField schema[] = {
+    {"name",               "name",    DisplayName},
+    {"command_topic",      "cmd_t",   CommandTopic},
+    {"availability_topic", "avty_t",  AvailabilityTopic},
+    {"unique_id",          "uniq_id", UniqueId},
+    {"device_class",       "dev_cla", DeviceClass},
+  };
 
-  const char* deviceClasses2Str[__DEVICE_CLASSES_MAX] = {
+  static constexpr const char* deviceClasses2Str[__DEVICE_CLASSES_MAX] = {
     "None",     // DeviceClasses::None
     "identify", // DeviceClasses::identify
     "restart",  // DeviceClasses::restart
@@ -696,12 +1339,28 @@ public:
 	 *
 	 * @return A Lock object with the specified parameters.
 	 */
-  Lock(const String name, const String displayName, MQTT_HASS &client, Device dev, void (*callbackPtr)(char*, uint8_t*, unsigned int));
+  Lock(const String name, const String displayName, MQTT_HASS &client, const Device &dev, void (*callbackPtr)(char*, uint8_t*, unsigned int));
+
+	/**
+	 * @brief Constructs a Lock object whose callback receives the payload as a PayloadView.
+	 *
+	 * @param name The name of the lock. (DO NOT USE ANY SPACES)
+	 * @param displayName The display name of the lock.
+	 * @param client A reference to the MQTT_HASS instance.
+	 * @param dev The device information for the lock.
+	 * @param callbackPtr A pointer to the callback function for handling lock actions.
+	 *
+	 * @return A Lock object with the specified parameters.
+	 */
+  Lock(const String name, const String displayName, MQTT_HASS &client, const Device &dev, void (*callbackPtr)(const char*, const PayloadView&));
+  /** Entities keep a reference to their Device, so a temporary one is rejected */
+  Lock(const String name, const String displayName, MQTT_HASS &client, Device &&dev, void (*callbackPtr)(char*, uint8_t*, unsigned int)) = delete;
+  Lock(const String name, const String displayName, MQTT_HASS &client, Device &&dev, void (*callbackPtr)(const char*, const PayloadView&)) = delete;
 
 	/**
 	 * @brief Publishes the discovery message for the lock.
 	 *
-	 * @note this is called automatically for you when you register the entity and does not need to be called manually.
+	 * @note this is called automatically for you by loop() after you register the entity and does not need to be called manually.
 	 *
 	 * @return true if the discovery message is successfully published, false otherwise.
 	 */
@@ -710,7 +1369,7 @@ public:
 	/**
 	 * @brief Publishes the availability message for the lock.
 	 *
-	 * @note this is called automatically for you when you register the entity and call publishAvailabilities().
+	 * @note this is called automatically for you when you connect and does not need to be called manually.
 	 *
 	 * @return true if the availability message is successfully published, false otherwise.
 	 */
@@ -726,7 +1385,15 @@ public:
 	 */
   bool updateState(States val);
 private:
-  const char* states2Str[__STATES_MAX] = {
+  static constexpr DiscoveryField schema[] = {
+    {"name",               "name",    DisplayName},
+    {"state_topic",        "stat_t",  StateTopic},
+    {"command_topic",      "cmd_t",   CommandTopic},
+    {"availability_topic", "avty_t",  AvailabilityTopic},
+    {"unique_id",          "uniq_id", UniqueId},
+  };
+
+  static constexpr const char* states2Str[__STATES_MAX] = {
     "UNLOCKED", // States::UNLOCKED
     "UNLOCKING",// States::UNLOCKING
     "LOCKED",   // States::LOCKED
@@ -797,13 +1464,33 @@ public:
 	 *
 	 * @return A Cover object with the specified parameters.
 	 */
-  Cover(const String name, const String displayName, MQTT_HASS &client, Device dev, void (*callbackPtr)(char*, uint8_t*, unsigned int),
+  Cover(const String name, const String displayName, MQTT_HASS &client, const Device &dev, void (*callbackPtr)(char*, uint8_t*, unsigned int),
         DeviceClasses deviceClass = DeviceClasses::None);
 
+	/**
+	 * @brief Constructs a Cover object whose callback receives the payload as a PayloadView.
+	 *
+	 * @param name The name of the cover. (DO NOT USE ANY SPACES)
+	 * @param displayName The display name of the cover.
+	 * @param client A reference to the MQTT_HASS instance.
+	 * @param dev The device information for the cover.
+	 * @param callbackPtr A pointer to the callback function for handling cover actions.
+	 * @param deviceClass The device class for the cover. (default None)
+	 *
+	 * @return A Cover object with the specified parameters.
+	 */
+  Cover(const String name, const String displayName, MQTT_HASS &client, const Device &dev, void (*callbackPtr)(const char*, const PayloadView&),
+        DeviceClasses deviceClass = DeviceClasses::None);
+  /** Entities keep a reference to their Device, so a temporary one is rejected */
+  Cover(const String name, const String displayName, MQTT_HASS &client, Device &&dev, void (*callbackPtr)(char*, uint8_t*, unsigned int),
+        DeviceClasses deviceClass = DeviceClasses::None) = delete;
+  Cover(const String name, const String displayName, MQTT_HASS &client, Device &&dev, void (*callbackPtr)(const char*, const PayloadView&),
+        DeviceClasses deviceClass = DeviceClasses::None) = delete;
+
 	/**
 	 * @brief Publishes the discovery message for the cover.
 	 *
-	 * @note this is called automatically for you when you register the entity and does not need to be called manually.
+	 * @note this is called automatically for you by loop() after you register the entity and does not need to be called manually.
 	 *
 	 * @return true if the discovery message is successfully published, false otherwise.
 	 */
@@ -812,7 +1499,7 @@ public:
 	/**
 	 * @brief Publishes the availability message for the cover.
 	 *
-	 * @note this is called automatically for you when you register the entity and call publishAvailabilities().
+	 * @note this is called automatically for you when you connect and does not need to be called manually.
 	 *
 	 * @return true if the availability message is successfully published, false otherwise.
 	 */
@@ -829,8 +1516,16 @@ public:
   bool updateState(States val);
 
 private:
-  DeviceClasses deviceClass_;
-  const char* states2Str[__STATES_MAX] = {
+  static constexpr DiscoveryField schema[] = {
+    {"name",               "name",    DisplayName},
+    {"state_topic",        "stat_t",  StateTopic},
+    {"command_topic",      "cmd_t",   CommandTopic},
+    {"availability_topic", "avty_t",  AvailabilityTopic},
+    {"unique_id",          "uniq_id", UniqueId},
+    {"device_class",       "dev_cla", DeviceClass},
+  };
+
+  static constexpr const char* states2Str[__STATES_MAX] = {
     "open",
     "closed",
     "opening",
@@ -838,7 +1533,7 @@ private:
     "stopped",
   };
 
-  const char* deviceClasses2Str[__DEVICE_CLASSES_MAX] = {
+  static constexpr const char* deviceClasses2Str[__DEVICE_CLASSES_MAX] = {
     "None",
     "awning",
     "blind",
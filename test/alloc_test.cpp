@@ -0,0 +1,95 @@
+// Checks that steady-state state updates, flushes, command dispatch and rediscovery never touch the heap.
+#include "MQTT_HASS.h"
+#include <new>
+
+static long allocations = 0;
+static bool counting = false;
+
+void *operator new(size_t size) { if (counting) allocations++; return malloc(size); }
+void *operator new[](size_t size) { if (counting) allocations++; return malloc(size); }
+void operator delete(void *ptr) noexcept { free(ptr); }
+void operator delete[](void *ptr) noexcept { free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { free(ptr); }
+
+// Long enough that the stub String, which wraps std::string, cannot hide an allocation in its inline buffer
+Device dev = { .name = "alloc_test_device", .model = "Host" };
+static int commands = 0;
+void commandCallback(const char*, const PayloadView &payload) { commands++; }
+
+static bool check(const char *what, long expected, long actual) {
+  printf("%-48s %s (%ld)\n", what, expected == actual ? "ok" : "FAILED", actual);
+  return expected == actual;
+}
+
+int main() {
+  byte ip[] = {127, 0, 0, 1};
+  MQTT_HASS &client = MQTT_HASS::getInstance(ip, 1883);
+  BinarySensor tamper("tamper", "Tamper", client, dev);
+  Lock lock("lock", "Lock", client, dev, commandCallback);
+  Cover cover("cover", "Cover", client, dev, commandCallback);
+  Sensor health("health", "Health", client, dev);
+  Sensor temperature("temperature", "Temperature", client, dev, Sensor::DeviceClasses::temperature, "C");
+  Entity *entities[] = {&tamper, &lock, &cover, &health, &temperature};
+  for (Entity *entity : entities)
+    client.registerEntity(entity);
+
+  client.connect("user", "password");
+  client.loop();
+  // The stub's publish log would allocate, so it is switched off while counting
+  client.record = false;
+  bool ok = true;
+
+  counting = true;
+  allocations = 0;
+  for (int i = 0; i < 100; i++) {
+    tamper.updateState(i % 2 ? BinarySensor::ON : BinarySensor::OFF);
+    lock.updateState(Lock::LOCKED);
+    cover.updateState(Cover::OPEN);
+    health.updateState("healthy");
+    temperature.updateState(20.0f + i / 10.0f);
+    temperature.updateState(i);
+  }
+  ok &= check("immediate updates", 0, allocations);
+
+  allocations = 0;
+  client.setDeferredPublishing(true);
+  for (int i = 0; i < 100; i++) {
+    temperature.updateStateFixed(2000 + i, 2);
+    client.loop();
+  }
+  client.setDeferredPublishing(false);
+  ok &= check("deferred updates flushed by loop()", 0, allocations);
+
+  allocations = 0;
+  char topic[] = "homeassistant/lock/particle_alloc_test_device/lock/command";
+  uint8_t payload[] = "LOCK";
+  for (int i = 0; i < 100; i++)
+    client.globalCallback(topic, payload, 4);
+  counting = false;
+  ok &= check("command dispatch", 0, allocations);
+  ok &= check("commands delivered", 100, commands);
+
+  // Home Assistant's birth message makes the next loop() resend every config, the availability and the states
+  char status[] = "homeassistant/status";
+  uint8_t online[] = "online";
+  MQTT_HASS::DiscoveryModes modes[] = {MQTT_HASS::DiscoveryModes::PerEntity, MQTT_HASS::DiscoveryModes::PerDevice};
+  for (MQTT_HASS::DiscoveryModes mode : modes) {
+    client.setDiscoveryMode(mode);
+    client.loop();
+    int published = client.published;
+    hal_calls = 0;
+    counting = true;
+    allocations = 0;
+    client.globalCallback(status, online, 6);
+    client.loop();
+    counting = false;
+    bool perEntity = mode == MQTT_HASS::DiscoveryModes::PerEntity;
+    ok &= check(perEntity ? "per-entity rediscovery" : "device rediscovery", 0, allocations);
+    ok &= check("  serial number reads", 0, hal_calls);
+    // One config per entity (or one for the device), the availability and the five cached states
+    ok &= check("  messages published", (perEntity ? 5 : 1) + 1 + 5, client.published - published);
+  }
+
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,37 @@
+// Measures how long globalCallback() takes to route a command to the last registered of N command entities.
+// Usage: dispatch_bench <entities>
+#include "MQTT_HASS.h"
+#include <chrono>
+
+Device dev = { .name = "bench", .model = "Host" };
+static volatile int hits = 0;
+void commandCallback(char*, uint8_t*, unsigned int) { hits++; }
+
+int main(int argc, char **argv) {
+  int count = argc > 1 ? atoi(argv[1]) : 10;
+  if (count < 1 || count > MQTT_HASS_MAX_ENTITIES) {
+    fprintf(stderr, "entities must be between 1 and MQTT_HASS_MAX_ENTITIES (%d)\n", MQTT_HASS_MAX_ENTITIES);
+    return 1;
+  }
+
+  byte ip[] = {127, 0, 0, 1};
+  MQTT_HASS &client = MQTT_HASS::getInstance(ip, 1883);
+  client.connect("user", "password");
+  std::vector<Button*> buttons;
+  for (int i = 0; i < count; i++) {
+    buttons.push_back(new Button(String("b") + String(i), "Button", client, dev, commandCallback));
+    client.registerEntity(buttons.back());
+  }
+
+  std::string topic = "homeassistant/button/particle_bench/b" + std::to_string(count - 1) + "/command";
+  uint8_t payload[] = "PRESS";
+  int iterations = 200000 / count + 1000;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++)
+    client.globalCallback(&topic[0], payload, 5);
+  auto end = std::chrono::steady_clock::now();
+
+  double ns = std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+  printf("%4d entities: %6.0f ns/dispatch\n", count, ns);
+  return hits == iterations ? 0 : 1;
+}
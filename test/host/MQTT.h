@@ -0,0 +1,36 @@
+// Host stand-in for the MQTT library. It never touches the network: publishes and subscriptions are recorded in
+// pubs and subs (published counts them even when recording is off), and the packet size limit is enforced like the real library does.
+#pragma once
+#include "Particle.h"
+#define MQTT_MAX_HEADER_SIZE 5
+struct Pub { std::string topic; std::string payload; bool retain; };
+extern std::vector<Pub> pubs;
+extern std::vector<std::string> subs;
+class MQTT {
+public:
+  typedef enum { QOS0 = 0, QOS1 = 1, QOS2 = 2 } EMQTT_QOS;
+  typedef enum { MQTT_V311 = 4 } MQTT_VERSION;
+  MQTT(const char* domain, uint16_t port, int maxpacketsize, void (*cb)(char*, uint8_t*, unsigned int), bool thread = false) : cb_(cb), maxp_(maxpacketsize) {}
+  MQTT(const uint8_t* ip, uint16_t port, int maxpacketsize, void (*cb)(char*, uint8_t*, unsigned int), bool thread = false) : cb_(cb), maxp_(maxpacketsize) {}
+  bool connect(const char* id) { connected_ = true; return true; }
+  bool connect(const char* id, const char* user, const char* pass) { connected_ = true; return true; }
+  bool connect(const char* id, const char* user, const char* pass, const char* willTopic, EMQTT_QOS willQos, uint8_t willRetain, const char* willMessage, bool cleanSession, MQTT_VERSION version = MQTT_V311) { lastId = id; will = willTopic; connected_ = connectOk; return connected_; }
+  void disconnect() { connected_ = false; }
+  bool publish(const char* topic, const char* payload) { return publish(topic, (const uint8_t*)payload, strlen(payload), false); }
+  bool publish(const char* topic, const char* payload, bool retain) { return publish(topic, (const uint8_t*)payload, strlen(payload), retain); }
+  bool publish(const char* topic, const uint8_t* p, unsigned int l) { return publish(topic, p, l, false); }
+  bool publish(const char* topic, const uint8_t* p, unsigned int l, bool retain) { if (!connected_) return false; if (MQTT_MAX_HEADER_SIZE + 2 + strlen(topic) + l > (unsigned)maxp_) return false; published++; if (record) pubs.push_back({topic, std::string((const char*)p, l), retain}); return true; }
+  bool publish(const char* topic, const uint8_t* p, unsigned int l, bool retain, EMQTT_QOS qos, uint16_t* messageid = NULL) { return publish(topic, p, l, retain); }
+  bool subscribe(const char* topic) { if (!connected_) return false; subs.push_back(topic); return true; }
+  bool subscribe(const char* topic, EMQTT_QOS) { return subscribe(topic); }
+  bool unsubscribe(const char* topic) { return true; }
+  bool loop() { return connected_; }
+  bool isConnected() { return connected_; }
+  bool connected_ = false;
+  bool connectOk = true;
+  bool record = true;
+  int published = 0;
+  std::string lastId, will;
+  void (*cb_)(char*, uint8_t*, unsigned int);
+  int maxp_;
+};
@@ -0,0 +1,70 @@
+// Minimal host stand-ins for the Device OS APIs used by MQTT_HASS, just enough to build and run the library
+// on a PC. Behaviour only mirrors what the tests rely on.
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cstdarg>
+#include <string>
+#include <vector>
+typedef uint8_t byte;
+inline uint32_t HAL_RNG_GetRandomNumber() { return rand(); }
+#define HAL_DEVICE_SERIAL_NUMBER_SIZE 15
+extern int hal_calls;
+inline int hal_get_device_serial_number(char* s, size_t n, void*) { hal_calls++; memcpy(s, "ABCDEF123456789", n < 15 ? n : 15); return 0; }
+class String {
+public:
+  std::string s;
+  String() {}
+  String(const char* c) : s(c ? c : "") {}
+  String(const String& o) = default;
+  String& operator=(const String&) = default;
+  explicit String(int v) : s(std::to_string(v)) {}
+  explicit String(unsigned int v) : s(std::to_string(v)) {}
+  const char* c_str() const { return s.c_str(); }
+  unsigned length() const { return s.size(); }
+  operator const char*() const { return s.c_str(); }
+  bool operator==(const char* o) const { return s == o; }
+  bool operator!=(const char* o) const { return s != o; }
+  friend String operator+(const String& a, const String& b) { String r(a); r.s += b.s; return r; }
+  friend String operator+(const String& a, const char* b) { String r(a); r.s += b; return r; }
+  friend String operator+(const char* a, const String& b) { String r(a); r.s += b.s; return r; }
+};
+class JSONWriter {
+public:
+  JSONWriter() : first_(true) {}
+  virtual ~JSONWriter() = default;
+  JSONWriter& beginArray() { sep(); write("[",1); first_=true; return *this; }
+  JSONWriter& endArray() { write("]",1); first_=false; return *this; }
+  JSONWriter& beginObject() { sep(); write("{",1); first_=true; return *this; }
+  JSONWriter& endObject() { write("}",1); first_=false; return *this; }
+  JSONWriter& name(const char* n) { return name(n, strlen(n)); }
+  JSONWriter& name(const char* n, size_t sz) { sep(); str(n, sz); write(":",1); first_=true; afterName_=true; return *this; }
+  JSONWriter& value(int v) { return num("%d", v); }
+  JSONWriter& value(double v, int p) { char b[64]; int n=snprintf(b,64,"%.*f",p,v); sep(); write(b,n); return *this; }
+  JSONWriter& value(const char* v) { return value(v, strlen(v)); }
+  JSONWriter& value(const char* v, size_t sz) { sep(); str(v, sz); return *this; }
+  JSONWriter& value(const String& v) { return value(v.c_str()); }
+protected:
+  virtual void write(const char* data, size_t size) = 0;
+private:
+  bool first_; bool afterName_ = false;
+  template<typename T> JSONWriter& num(const char* f, T v) { char b[32]; int n=snprintf(b,32,f,v); sep(); write(b,n); return *this; }
+  void sep() { if (afterName_) { afterName_=false; first_=false; return; } if (!first_) write(",",1); first_=false; }
+  void str(const char* s, size_t n) { write("\"",1); write(s,n); write("\"",1); }
+};
+class JSONBufferWriter : public JSONWriter {
+public:
+  JSONBufferWriter(char* buf, size_t size) : buf_(buf), bufSize_(size), n_(0) {}
+  size_t bufferSize() const { return bufSize_; }
+  size_t dataSize() const { return n_; }
+protected:
+  void write(const char* d, size_t s) override { if (n_ < bufSize_) memcpy(buf_+n_, d, (n_+s<=bufSize_)?s:bufSize_-n_); n_ += s; }
+private:
+  char* buf_; size_t bufSize_; size_t n_;
+};
+struct LogClass { void error(const char* f, ...) { va_list a; va_start(a,f); vprintf(f,a); va_end(a); ::printf("\n"); } };
+extern LogClass Log;
+extern unsigned long fake_millis;
+inline unsigned long millis() { return fake_millis; }
@@ -0,0 +1,7 @@
+#include "MQTT.h"
+
+int hal_calls = 0;
+LogClass Log;
+unsigned long fake_millis = 0;
+std::vector<Pub> pubs;
+std::vector<std::string> subs;